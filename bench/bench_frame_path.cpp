@@ -0,0 +1,140 @@
+/* Frame path benchmark, end to end: a recorded session (a capture file, see set_capture_file()) is replayed as fast as
+ * the loop takes it, so every RTP packet goes through live555's depacketizer, DummySink and the frame slots to a callback
+ * that does nothing but count.  Reports per delivered frame:
+ *   ns/frame     wall time between the first and the last callback.  The replay writes the packets into the loopback
+ *                connection from the same loop thread, so this includes those send() calls and is an upper bound; the
+ *                sink's own share (RTSP_CLIENT_FRAME_TIMING) is shown next to it
+ *   allocs/frame operator new calls in the same window (live555 and the client allocate through it)
+ * bench_sink_stages times the sink's steps one by one, without live555.
+ *
+ *   bench_frame_path capture_file [runs=5] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#include "../parse_rtsp.h"
+#include "../rtsp_capture.h"
+
+static volatile LONG g_allocs = 0;
+
+void* operator new(size_t size)
+{
+	InterlockedIncrement(&g_allocs);
+	void* p = malloc(size ? size : 1);
+	if(NULL == p) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p)
+{
+	free(p);
+}
+
+void operator delete[](void* p)
+{
+	free(p);
+}
+
+typedef struct SBenchFrames
+{
+	unsigned __int64 frames;
+	unsigned __int64 first_ns;
+	unsigned __int64 last_ns;
+	LONG first_allocs;
+	LONG last_allocs;
+}SBenchFrames;
+
+static unsigned __int64 qpc_ns()
+{
+	static LONGLONG frequency = 0;
+	if(0 == frequency)
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency = f.QuadPart;
+	}
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (unsigned __int64)(counter.QuadPart / frequency) * 1000000000 + (unsigned __int64)(counter.QuadPart % frequency) * 1000000000 / frequency;
+}
+
+static void __stdcall on_frame(unsigned char* data, int data_len, SLive_RtspDataInfo data_info, void* user_param)
+{
+	SBenchFrames* frames = (SBenchFrames*)user_param;
+
+	unsigned __int64 now = qpc_ns();
+	if(0 == frames->frames++)
+	{
+		frames->first_ns = now;
+		frames->first_allocs = g_allocs;
+	}
+	frames->last_ns = now;
+	frames->last_allocs = g_allocs;
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "usage: bench_frame_path capture_file [runs=5]\n");
+		return 1;
+	}
+	int runs = (argc > 2) ? atoi(argv[2]) : 5;
+
+	/* what the replay will feed in */
+	unsigned __int64 rtp_packets = 0, rtp_bytes = 0;
+	{
+		CRtspCaptureReader reader;
+		if(!reader.open(argv[1]))
+		{
+			fprintf(stderr, "cannot open the capture file \"%s\"\n", argv[1]);
+			return 1;
+		}
+
+		SRtspCaptureRecord record;
+		const unsigned char* payload;
+		while(reader.next(record, payload))
+		{
+			if(RTSP_CAPTURE_RTP != record.type) continue;
+			++rtp_packets;
+			rtp_bytes += record.length;
+		}
+	}
+	printf("%s: %I64u RTP packets, %I64u bytes\n", argv[1], rtp_packets, rtp_bytes);
+
+	CRTSPClient client;
+	for(int i = 0; i < runs; ++i)
+	{
+		SBenchFrames frames;
+		memset(&frames, 0, sizeof(frames));
+
+		client.run_replay(argv[1], on_frame, &frames);
+		while(!client.replay_finished()) Sleep(1);
+		client.stop();
+
+		SLive_RtspFrameStats stats;
+		client.get_frame_stats(stats);
+		if(frames.frames < 2)
+		{
+			fprintf(stderr, "run %d: %I64u frame(s) delivered, nothing to measure\n", i, frames.frames);
+			return 1;
+		}
+
+		unsigned __int64 intervals = frames.frames - 1;
+		printf("run %d: %I64u frames (%I64u damaged)  %8.0f ns/frame (sink %6.0f)  %6.2f allocs/frame\n",
+			i, frames.frames, stats.damaged_frames,
+			(double)(frames.last_ns - frames.first_ns) / intervals,
+			stats.frames ? (double)stats.dispatch_ns / stats.frames : 0.0,
+			(double)(frames.last_allocs - frames.first_allocs) / intervals);
+	}
+
+	return 0;
+}
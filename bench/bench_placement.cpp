@@ -0,0 +1,190 @@
+/* Placement benchmark: what set_placement() / colocate_with_current_thread() buy on the frame path.
+ * A "loop" thread receives frames into the slots of a CRtspFrameQueue (a memcpy from a packet buffer stands in for
+ * the socket) and a consumer thread reads every cache line of each frame and releases it, as a pull mode user would.
+ * The same run is repeated with the loop unpinned, colocated with the consumer, and (on a multi-node machine) on
+ * another node than the consumer, and reports ns/frame and MB/s for each.
+ *
+ * The cross-node traffic itself is not counted: Windows has no per-node remote access counters for user mode, those
+ * live in the uncore PMU (Intel PCM, VTune, AMD uProf).  MB/s stands in for them here.  The slots live on the loop's
+ * node and the consumer reads every cache line of every frame, so in the "remote" run all frame_size * frames bytes
+ * cross the interconnect, in the "colocated" run none do, and the MB/s difference between the two is what that costs.
+ * Run a PMU tool alongside to see the remote accesses as such.
+ *
+ *   bench_placement [frames=200000] [frame_size=65536] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <process.h>
+
+#include "../rtsp_placement.h"
+#include "../rtsp_frame_queue.h"
+
+#define BENCH_SLOT_COUNT	16
+#define BENCH_POP_BATCH		16
+
+typedef struct SBenchRun
+{
+	const char* name;
+	SLive_RtspPlacement loop_placement;
+	SLive_RtspPlacement consumer_placement;
+	int frames;
+	unsigned frame_size;
+
+	CRtspFrameQueue* queue;
+	volatile LONG loop_ready;
+	unsigned __int64 checksum;
+}SBenchRun;
+
+static unsigned __int64 qpc_ns()
+{
+	static LONGLONG frequency = 0;
+	if(0 == frequency)
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency = f.QuadPart;
+	}
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (unsigned __int64)(counter.QuadPart / frequency) * 1000000000 + (unsigned __int64)(counter.QuadPart % frequency) * 1000000000 / frequency;
+}
+
+static SLive_RtspPlacement node_placement(int node)
+{
+	SLive_RtspPlacement placement;
+
+	GROUP_AFFINITY affinity;
+	if(!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity)) return placement;
+
+	placement.cpu_group = affinity.Group;
+	placement.cpu_mask = affinity.Mask;
+	placement.numa_node = node;
+	return placement;
+}
+
+static unsigned __stdcall loop_thread(void* param)
+{
+	SBenchRun* run = (SBenchRun*)param;
+
+	DWORD error = 0;
+	int numa_node = rtsp_apply_placement(run->loop_placement, error);
+	if(0 != error) fprintf(stderr, "%s: SetThreadGroupAffinity failed (%lu), loop unpinned\n", run->name, error);
+
+	/* the "socket buffer" lives where the loop runs, like the kernel's would */
+	unsigned char* packet = rtsp_alloc_buffer(run->frame_size, numa_node);
+	memset(packet, 0x5a, run->frame_size);
+
+	run->queue->attach(numa_node);
+	InterlockedExchange(&run->loop_ready, 1);
+
+	SLive_RtspDataInfo data_info;
+	for(int i = 0; i < run->frames; ++i)
+	{
+		int slot;
+		while((slot = run->queue->acquire_slot()) < 0) YieldProcessor();
+
+		memcpy(run->queue->slot_data(slot), packet, run->frame_size);
+		run->queue->publish(slot, run->frame_size, data_info);
+	}
+
+	rtsp_free_buffer(packet);
+	return 0;
+}
+
+static double run_bench(SBenchRun& run)
+{
+	/* the consumer is this thread: put it back afterwards, so that no run inherits the pinning of the one before */
+	GROUP_AFFINITY previous_affinity;
+	BOOL have_previous = GetThreadGroupAffinity(GetCurrentThread(), &previous_affinity);
+
+	DWORD error = 0;
+	rtsp_apply_placement(run.consumer_placement, error);
+	if(0 != error) fprintf(stderr, "%s: SetThreadGroupAffinity failed (%lu), consumer unpinned\n", run.name, error);
+
+	run.queue = new CRtspFrameQueue(BENCH_SLOT_COUNT, run.frame_size, NULL, NULL);
+	run.loop_ready = 0;
+	run.checksum = 0;
+
+	HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, loop_thread, &run, 0, NULL);
+	while(0 == run.loop_ready) Sleep(0);
+
+	unsigned __int64 start = qpc_ns();
+	SLive_RtspFrame frames[BENCH_POP_BATCH];
+	for(int received = 0; received < run.frames; )
+	{
+		int count = run.queue->try_pop(frames, BENCH_POP_BATCH);
+		if(0 == count)
+		{
+			YieldProcessor();
+			continue;
+		}
+
+		for(int i = 0; i < count; ++i)
+		{
+			for(int offset = 0; offset < frames[i].data_len; offset += 64) run.checksum += frames[i].data[offset];
+			run.queue->release(frames[i]);
+		}
+		received += count;
+	}
+	unsigned __int64 elapsed = qpc_ns() - start;
+
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	delete run.queue;
+
+	if(have_previous && !SetThreadGroupAffinity(GetCurrentThread(), &previous_affinity, NULL))
+	{
+		fprintf(stderr, "%s: failed to restore the consumer's affinity (%lu)\n", run.name, GetLastError());
+	}
+
+	double ns_per_frame = (double)elapsed / run.frames;
+	printf("%-10s loop node %2d  consumer node %2d  %10.0f ns/frame  %8.1f MB/s\n", run.name, run.loop_placement.numa_node,
+		run.consumer_placement.numa_node, ns_per_frame, (double)run.frame_size * run.frames / (elapsed / 1000.0));
+	return ns_per_frame;
+}
+
+int main(int argc, char* argv[])
+{
+	int frames = (argc > 1) ? atoi(argv[1]) : 200000;
+	unsigned frame_size = (argc > 2) ? (unsigned)atoi(argv[2]) : 65536;
+
+	ULONG highest_node = 0;
+	GetNumaHighestNodeNumber(&highest_node);
+	printf("%d frames of %u bytes, %lu NUMA node(s)\n", frames, frame_size, highest_node + 1);
+
+	SBenchRun runs[3];
+	int run_count = 0;
+
+	/* before: nothing pinned, buffers wherever the first touch happens to land */
+	runs[run_count].name = "unpinned";
+	++run_count;
+
+	/* after: the consumer sits on node 0 and the loop is colocated with it, as colocate_with_current_thread() does */
+	runs[run_count].name = "colocated";
+	runs[run_count].consumer_placement = node_placement(0);
+	runs[run_count].loop_placement = runs[run_count].consumer_placement;
+	++run_count;
+
+	/* the case placement exists to avoid: every frame crosses the interconnect */
+	if(highest_node > 0)
+	{
+		runs[run_count].name = "remote";
+		runs[run_count].consumer_placement = node_placement(0);
+		runs[run_count].loop_placement = node_placement((int)highest_node);
+		++run_count;
+	}
+
+	unsigned __int64 checksum = 0;
+	for(int i = 0; i < run_count; ++i)
+	{
+		runs[i].frames = frames;
+		runs[i].frame_size = frame_size;
+		run_bench(runs[i]);
+		checksum += runs[i].checksum;
+	}
+	printf("(checksum %I64u)\n", checksum);
+
+	return 0;
+}
@@ -0,0 +1,382 @@
+/* Sink stage microbenchmarks: the per-frame helpers of rtsp_frame.h and the callback dispatch of CRtspFrameQueue, timed
+ * one at a time over the H.264 frames of a recorded session.  No live555 and no network: the capture file's RTP packets
+ * are depacketized here (single NAL units, STAP-A, FU-A, as live555's H264VideoRTPSource would) into the NAL units the
+ * sink gets, with the damaged flag a gap in the sequence numbers gives them.  Each stage runs over the whole corpus
+ * "passes" times and the best pass is reported, per frame:
+ *   ns/frame     QueryPerformanceCounter around the pass
+ *   allocs/frame operator new calls during the pass (the sink path should have none)
+ *
+ *   bench_sink_stages capture_file [passes=20] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../rtsp_frame.h"
+#include "../rtsp_frame_queue.h"
+#include "../rtsp_capture.h"
+
+static volatile LONG g_allocs = 0;
+
+void* operator new(size_t size)
+{
+	InterlockedIncrement(&g_allocs);
+	void* p = malloc(size ? size : 1);
+	if(NULL == p) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p)
+{
+	free(p);
+}
+
+void operator delete[](void* p)
+{
+	free(p);
+}
+
+typedef struct SCorpusFrame
+{
+	size_t offset;					//into SCorpus::data
+	unsigned size;
+	long tv_sec;
+	long tv_usec;
+	bool damaged;
+}SCorpusFrame;
+
+typedef struct SCorpus
+{
+	std::vector<unsigned char> data;
+	std::vector<SCorpusFrame> frames;
+	unsigned max_frame_size;
+	unsigned damaged;
+}SCorpus;
+
+/* what the stages work on; the results go into "sink" so that nothing is optimized away */
+typedef struct SStageContext
+{
+	const SCorpus* corpus;
+	CRtspFrameQueue* queue;
+	unsigned __int64 sink;
+}SStageContext;
+
+typedef void stage_proc(SStageContext& context);
+
+static unsigned __int64 qpc_ns()
+{
+	static LONGLONG frequency = 0;
+	if(0 == frequency)
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency = f.QuadPart;
+	}
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (unsigned __int64)(counter.QuadPart / frequency) * 1000000000 + (unsigned __int64)(counter.QuadPart % frequency) * 1000000000 / frequency;
+}
+
+/* index of the first H.264 "m=" section of the SDP, -1 if there is none */
+static int h264_subsession(const std::string& sdp)
+{
+	int index = -1;
+	for(size_t pos = sdp.find("\nm="); std::string::npos != pos; pos = sdp.find("\nm=", pos + 1))
+	{
+		++index;
+		size_t end = sdp.find("\nm=", pos + 1);
+		std::string section = sdp.substr(pos, (std::string::npos != end) ? end - pos : std::string::npos);
+		if(0 == section.compare(0, 9, "\nm=video ") && std::string::npos != section.find(" H264/")) return index;
+	}
+
+	return -1;
+}
+
+typedef struct SDepacketizer
+{
+	bool have_seq;
+	unsigned short next_seq;
+	bool loss;						//packets went missing since the last NAL unit was completed
+	bool in_fu;
+	size_t fu_offset;				//where the FU-A being reassembled starts in SCorpus::data
+	unsigned __int64 first_timestamp;
+	bool have_timestamp;
+}SDepacketizer;
+
+/* the NAL unit at the end of SCorpus::data, from "offset" on */
+static void add_frame(SCorpus& corpus, SDepacketizer& depacketizer, size_t offset, unsigned timestamp)
+{
+	SCorpusFrame frame;
+	frame.offset = offset;
+	frame.size = (unsigned)(corpus.data.size() - offset);
+
+	unsigned __int64 ticks = (unsigned)(timestamp - (unsigned)depacketizer.first_timestamp);
+	frame.tv_sec = (long)(ticks / 90000);
+	frame.tv_usec = (long)(ticks % 90000 * 1000000 / 90000);
+	frame.damaged = depacketizer.loss;
+	depacketizer.loss = false;
+
+	corpus.frames.push_back(frame);
+	if(frame.size > corpus.max_frame_size) corpus.max_frame_size = frame.size;
+	if(frame.damaged) ++corpus.damaged;
+}
+
+static void add_nal(SCorpus& corpus, SDepacketizer& depacketizer, const unsigned char* nal, unsigned size, unsigned timestamp)
+{
+	size_t offset = corpus.data.size();
+	corpus.data.insert(corpus.data.end(), nal, nal + size);
+	add_frame(corpus, depacketizer, offset, timestamp);
+}
+
+static void depacketize(SCorpus& corpus, SDepacketizer& depacketizer, const unsigned char* packet, unsigned size)
+{
+	if(size < 12 || 2 != (packet[0] >> 6)) return;
+
+	unsigned header = 12 + 4 * (packet[0] & 0x0f);
+	if((packet[0] & 0x10) && size >= header + 4) header += 4 + 4 * ((packet[header + 2] << 8) | packet[header + 3]);
+	if((packet[0] & 0x20) && size > 0) size -= packet[size - 1];
+	if(header >= size) return;
+
+	unsigned short seq = (unsigned short)((packet[2] << 8) | packet[3]);
+	unsigned timestamp = ((unsigned)packet[4] << 24) | ((unsigned)packet[5] << 16) | ((unsigned)packet[6] << 8) | packet[7];
+	if(depacketizer.have_seq && seq != depacketizer.next_seq) depacketizer.loss = true;
+	depacketizer.have_seq = true;
+	depacketizer.next_seq = (unsigned short)(seq + 1);
+	if(!depacketizer.have_timestamp)
+	{
+		depacketizer.have_timestamp = true;
+		depacketizer.first_timestamp = timestamp;
+	}
+
+	const unsigned char* payload = packet + header;
+	unsigned payload_size = size - header;
+	unsigned nal_type = payload[0] & 0x1f;
+
+	if(nal_type >= 1 && nal_type <= 23)
+	{
+		depacketizer.in_fu = false;
+		add_nal(corpus, depacketizer, payload, payload_size, timestamp);
+	}
+	else if(24 == nal_type)		/* STAP-A */
+	{
+		depacketizer.in_fu = false;
+		for(unsigned pos = 1; pos + 2 <= payload_size; )
+		{
+			unsigned nal_size = (payload[pos] << 8) | payload[pos + 1];
+			pos += 2;
+			if(0 == nal_size || pos + nal_size > payload_size) break;
+			add_nal(corpus, depacketizer, payload + pos, nal_size, timestamp);
+			pos += nal_size;
+		}
+	}
+	else if(28 == nal_type && payload_size > 2)		/* FU-A */
+	{
+		bool start = 0 != (payload[1] & 0x80);
+		bool end = 0 != (payload[1] & 0x40);
+		if(start)
+		{
+			depacketizer.in_fu = true;
+			depacketizer.fu_offset = corpus.data.size();
+			corpus.data.push_back((unsigned char)((payload[0] & 0xe0) | (payload[1] & 0x1f)));
+		}
+		else if(!depacketizer.in_fu)
+		{
+			depacketizer.loss = true;		/* the start of this NAL unit is gone, live555 drops the rest as well */
+			return;
+		}
+		corpus.data.insert(corpus.data.end(), payload + 2, payload + payload_size);
+
+		if(end)
+		{
+			depacketizer.in_fu = false;
+			add_frame(corpus, depacketizer, depacketizer.fu_offset, timestamp);
+		}
+	}
+}
+
+static bool load_corpus(const char* path, SCorpus& corpus)
+{
+	CRtspCaptureReader reader;
+	if(!reader.open(path))
+	{
+		fprintf(stderr, "cannot open the capture file \"%s\"\n", path);
+		return false;
+	}
+
+	corpus.max_frame_size = 0;
+	corpus.damaged = 0;
+
+	SDepacketizer depacketizer;
+	memset(&depacketizer, 0, sizeof(depacketizer));
+
+	int subsession = -1;
+	SRtspCaptureRecord record;
+	const unsigned char* payload;
+	while(reader.next(record, payload))
+	{
+		if(RTSP_CAPTURE_SDP == record.type)
+		{
+			if(subsession >= 0) break;		/* the next session of a capture that reconnected */
+			subsession = h264_subsession(std::string((const char*)payload, record.length));
+			continue;
+		}
+		if(RTSP_CAPTURE_RTP != record.type || subsession < 0 || record.subsession != (unsigned)subsession) continue;
+
+		depacketize(corpus, depacketizer, payload, record.length);
+	}
+
+	if(corpus.frames.empty())
+	{
+		fprintf(stderr, "\"%s\" holds no H.264 frames\n", path);
+		return false;
+	}
+	return true;
+}
+
+
+/* the stages, in the order the sink runs them for a frame */
+
+static void stage_frame_info_template(SStageContext& context)
+{
+	/* once per subsession in the sink; timed per call here so that a costlier template would show */
+	SLive_RtspDataInfo info;
+	for(size_t i = 0; i < context.corpus->frames.size(); ++i)
+	{
+		rtsp_frame_info_template(RTSP_SINK_CODEC_H264, 0, 90000, info);
+		context.sink += info.data_type;
+	}
+}
+
+static void stage_pts_90k(SStageContext& context)
+{
+	const std::vector<SCorpusFrame>& frames = context.corpus->frames;
+	for(size_t i = 0; i < frames.size(); ++i)
+	{
+		context.sink += rtsp_pts_90k(frames[i].tv_sec, frames[i].tv_usec);
+	}
+}
+
+static void stage_h264_is_key(SStageContext& context)
+{
+	const SCorpus& corpus = *context.corpus;
+	for(size_t i = 0; i < corpus.frames.size(); ++i)
+	{
+		context.sink += rtsp_h264_is_key(&corpus.data[corpus.frames[i].offset], corpus.frames[i].size);
+	}
+}
+
+static void stage_stamp_frame(SStageContext& context)
+{
+	const SCorpus& corpus = *context.corpus;
+	SLive_RtspDataInfo info;
+	rtsp_frame_info_template(RTSP_SINK_CODEC_H264, 0, 90000, info);
+	for(size_t i = 0; i < corpus.frames.size(); ++i)
+	{
+		const SCorpusFrame& frame = corpus.frames[i];
+		rtsp_stamp_frame(RTSP_SINK_CODEC_H264, &corpus.data[frame.offset], frame.size, frame.tv_sec, frame.tv_usec, info);
+		context.sink += info.video_param.pts + info.video_param.is_i_frame;
+	}
+}
+
+static void stage_frame_integrity(SStageContext& context)
+{
+	const SCorpus& corpus = *context.corpus;
+	SRtspIntegrityState state;
+	for(size_t i = 0; i < corpus.frames.size(); ++i)
+	{
+		const SCorpusFrame& frame = corpus.frames[i];
+		context.sink += rtsp_frame_integrity(state, RTSP_SINK_CODEC_H264, &corpus.data[frame.offset], frame.size, frame.damaged);
+	}
+}
+
+static void __stdcall on_frame(unsigned char* data, int data_len, SLive_RtspDataInfo data_info, void* user_param)
+{
+	*(unsigned __int64*)user_param += data_len;
+}
+
+static void stage_dispatch(SStageContext& context)
+{
+	/* acquire a slot, publish it to the callback and get it back, as the sink does once the frame is in the slot.
+	 * The payload is not copied: live555 writes it into the slot before the sink is called */
+	const SCorpus& corpus = *context.corpus;
+	SLive_RtspDataInfo info;
+	rtsp_frame_info_template(RTSP_SINK_CODEC_H264, 0, 90000, info);
+	for(size_t i = 0; i < corpus.frames.size(); ++i)
+	{
+		int slot = context.queue->acquire_slot();
+		context.queue->publish(slot, corpus.frames[i].size, info);
+	}
+}
+
+typedef struct SStage
+{
+	const char* name;
+	stage_proc* proc;
+}SStage;
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "usage: bench_sink_stages capture_file [passes=20]\n");
+		return 1;
+	}
+	int passes = (argc > 2) ? atoi(argv[2]) : 20;
+	if(passes < 1) passes = 1;
+
+	SCorpus corpus;
+	if(!load_corpus(argv[1], corpus)) return 1;
+	printf("%s: %u H.264 frames, %u bytes, %u damaged by loss\n", argv[1], (unsigned)corpus.frames.size(), (unsigned)corpus.data.size(),
+		corpus.damaged);
+
+	SStageContext context;
+	context.corpus = &corpus;
+	context.sink = 0;
+	context.queue = new CRtspFrameQueue(2, corpus.max_frame_size, on_frame, &context.sink);
+	context.queue->attach(-1);
+
+	static const SStage stages[] =
+	{
+		{"frame_info_template", stage_frame_info_template},
+		{"pts_90k", stage_pts_90k},
+		{"h264_is_key", stage_h264_is_key},
+		{"stamp_frame", stage_stamp_frame},
+		{"frame_integrity", stage_frame_integrity},
+		{"dispatch", stage_dispatch}
+	};
+
+	for(size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); ++s)
+	{
+		stages[s].proc(context);		/* warm up */
+
+		double best_ns = 0.0;
+		LONG best_allocs = 0;
+		for(int pass = 0; pass < passes; ++pass)
+		{
+			LONG allocs = g_allocs;
+			unsigned __int64 start = qpc_ns();
+			stages[s].proc(context);
+			unsigned __int64 elapsed = qpc_ns() - start;
+			allocs = g_allocs - allocs;
+
+			double ns = (double)elapsed / corpus.frames.size();
+			if(0 == pass || ns < best_ns) best_ns = ns;
+			if(allocs > best_allocs) best_allocs = allocs;
+		}
+
+		printf("%-20s %8.2f ns/frame  %6.2f allocs/frame\n", stages[s].name, best_ns, (double)best_allocs / corpus.frames.size());
+	}
+
+	delete context.queue;
+	printf("(checksum %I64u)\n", context.sink);
+	return 0;
+}
@@ -0,0 +1,229 @@
+/* Round trip of a capture through replay: writes a capture file of a synthetic H.264 session (one NAL unit per RTP
+ * packet, each carrying its own number) with CRtspCaptureWriter, reads it back with CRtspCaptureReader, replays it as
+ * fast as possible and checks that every packet in the file comes out of the callback once, in order and unchanged.
+ * With "srtp" the session is RTP/SAVP keyed by MIKEY, as a live555 server sends it: the packets are encrypted and
+ * authenticated with live555's own SRTP context before they go into the file, so the replay only gets the frames back if
+ * the client decrypts them.  Exit code 0 on success, 77 (a skip for ctest) when live555 was built without OpenSSL.
+ *
+ *   replay_roundtrip [packets=20000] [payload_size=1200] [srtp] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <string>
+
+#include "../parse_rtsp.h"
+#include "../rtsp_capture.h"
+
+#include "MIKEY.hh"
+#include "SRTPCryptographicContext.hh"
+#include "Base64.hh"
+
+#define ROUNDTRIP_SSRC			0x52545350
+#define ROUNDTRIP_TIMEOUT_MS	60000
+#define ROUNDTRIP_SRTP_TRAILER	64			//room for the MKI and authentication tag SRTP appends
+#define ROUNDTRIP_SKIPPED		77
+
+static const char* roundtrip_sdp =
+	"v=0\r\n"
+	"o=- 0 0 IN IP4 127.0.0.1\r\n"
+	"s=replay round trip\r\n"
+	"c=IN IP4 0.0.0.0\r\n"
+	"t=0 0\r\n"
+	"m=video 0 %s 96\r\n"
+	"a=rtpmap:96 H264/90000\r\n"
+	"a=control:track1\r\n"
+	"%s";
+
+typedef struct SRoundtrip
+{
+	std::vector<unsigned> expected;		//packet numbers in the file, in order
+	size_t next;
+	unsigned payload_size;
+	unsigned bad_frames;
+}SRoundtrip;
+
+/* NAL unit "number": an IDR slice header byte, the number, then a pattern derived from it */
+static void fill_nal(unsigned char* nal, unsigned number, unsigned size)
+{
+	nal[0] = 0x65;
+	for(int i = 0; i < 4; ++i) nal[1 + i] = (unsigned char)(number >> (24 - 8*i));
+	for(unsigned i = 5; i < size; ++i) nal[i] = (unsigned char)(number + i);
+}
+
+static bool check_nal(const unsigned char* nal, unsigned size, unsigned number)
+{
+	std::vector<unsigned char> expected(size);
+	fill_nal(&expected[0], number, size);
+	return 0 == memcmp(nal, &expected[0], size);
+}
+
+static unsigned nal_number(const unsigned char* nal)
+{
+	return ((unsigned)nal[1] << 24) | ((unsigned)nal[2] << 16) | ((unsigned)nal[3] << 8) | nal[4];
+}
+
+static void __stdcall on_frame(unsigned char* data, int data_len, SLive_RtspDataInfo data_info, void* user_param)
+{
+	SRoundtrip* roundtrip = (SRoundtrip*)user_param;
+
+	if(roundtrip->next >= roundtrip->expected.size() || (unsigned)data_len != roundtrip->payload_size
+		|| !check_nal(data, data_len, roundtrip->expected[roundtrip->next]))
+	{
+		if(roundtrip->bad_frames++ < 10)
+		{
+			fprintf(stderr, "frame %u: %d bytes, number %u, expected number %u\n", (unsigned)roundtrip->next, data_len,
+				data_len >= 5 ? nal_number(data) : 0, roundtrip->next < roundtrip->expected.size() ? roundtrip->expected[roundtrip->next] : 0);
+		}
+	}
+	++roundtrip->next;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned packets = (argc > 1) ? (unsigned)atoi(argv[1]) : 20000;
+	unsigned payload_size = (argc > 2) ? (unsigned)atoi(argv[2]) : 1200;
+	bool srtp = (argc > 3) && 0 == _stricmp(argv[3], "srtp");
+	if(payload_size < 5) payload_size = 5;
+	if(srtp && packets > 65535) packets = 65535;	/* the file is checked by sequence number, which must not wrap */
+
+	/* the keys go to the client in the SDP, the same way a live555 server hands them out */
+	MIKEYState* mikey = NULL;
+	SRTPCryptographicContext* crypto = NULL;
+	char sdp[1024];
+	if(srtp)
+	{
+		mikey = new MIKEYState();
+		unsigned mikey_size;
+		unsigned char* mikey_message = mikey->generateMessage(mikey_size);
+		char* mikey_base64 = base64Encode((char const*)mikey_message, mikey_size);
+		std::string key_mgmt = std::string("a=key-mgmt:mikey ") + mikey_base64 + "\r\n";
+		delete[] mikey_message;
+		delete[] mikey_base64;
+
+		_snprintf_s(sdp, sizeof(sdp), _TRUNCATE, roundtrip_sdp, "RTP/SAVP", key_mgmt.c_str());
+		crypto = new SRTPCryptographicContext(*mikey);
+	}
+	else
+	{
+		_snprintf_s(sdp, sizeof(sdp), _TRUNCATE, roundtrip_sdp, "RTP/AVP", "");
+	}
+
+	char path[MAX_PATH];
+	char dir[MAX_PATH];
+	GetTempPathA(sizeof(dir), dir);
+	GetTempFileNameA(dir, "rtc", 0, path);
+
+	/* capture */
+	{
+		CRtspCaptureWriter writer;
+		if(!writer.open(path))
+		{
+			fprintf(stderr, "cannot create \"%s\"\n", path);
+			return 1;
+		}
+
+		writer.write(RTSP_CAPTURE_SDP, 0, sdp, (unsigned)strlen(sdp));
+		std::vector<unsigned char> packet(12 + payload_size + ROUNDTRIP_SRTP_TRAILER);
+		for(unsigned i = 0; i < packets; ++i)
+		{
+			unsigned timestamp = i * 3000;
+			packet[0] = 0x80;									/* V=2 */
+			packet[1] = 0x80 | 96;								/* M=1, PT=96: every NAL unit is a whole picture */
+			packet[2] = (unsigned char)(i >> 8);
+			packet[3] = (unsigned char)i;
+			for(int b = 0; b < 4; ++b) packet[4 + b] = (unsigned char)(timestamp >> (24 - 8*b));
+			for(int b = 0; b < 4; ++b) packet[8 + b] = (unsigned char)(ROUNDTRIP_SSRC >> (24 - 8*b));
+			fill_nal(&packet[12], i, payload_size);
+
+			unsigned packet_size = 12 + payload_size;
+			if(NULL != crypto && !crypto->processOutgoingSRTPPacket(&packet[0], 12 + payload_size, packet_size))
+			{
+				fprintf(stderr, "live555 cannot encrypt SRTP (built with NO_OPENSSL?), skipped\n");
+				writer.close();
+				DeleteFileA(path);
+				return ROUNDTRIP_SKIPPED;
+			}
+			writer.write(RTSP_CAPTURE_RTP, 0, &packet[0], packet_size);
+			writer.flush_if_due();
+		}
+
+		if(writer.dropped_records() > 0) printf("the writer fell behind and dropped %I64u records\n", writer.dropped_records());
+		writer.close();
+	}
+
+	/* what the file holds: whole, unchanged records, in order */
+	SRoundtrip roundtrip;
+	roundtrip.next = 0;
+	roundtrip.payload_size = payload_size;
+	roundtrip.bad_frames = 0;
+	{
+		CRtspCaptureReader reader;
+		if(!reader.open(path))
+		{
+			fprintf(stderr, "cannot read \"%s\" back\n", path);
+			return 1;
+		}
+
+		SRtspCaptureRecord record;
+		const unsigned char* payload;
+		unsigned last = 0;
+		while(reader.next(record, payload))
+		{
+			if(RTSP_CAPTURE_RTP != record.type) continue;
+
+			/* SRTP leaves the header readable and makes the packet longer; the payload is only checked after the replay */
+			unsigned number = srtp ? (((unsigned)payload[2] << 8) | payload[3]) : nal_number(payload + 12);
+			bool intact = srtp ? (record.length > 12 + payload_size)
+				: (record.length == 12 + payload_size && check_nal(payload + 12, payload_size, number));
+			if(!intact || (!roundtrip.expected.empty() && number <= last))
+			{
+				fprintf(stderr, "capture record %u is damaged or out of order\n", (unsigned)roundtrip.expected.size());
+				return 1;
+			}
+			roundtrip.expected.push_back(number);
+			last = number;
+		}
+	}
+	printf("%u packets captured, %u in the file\n", packets, (unsigned)roundtrip.expected.size());
+
+	/* replay */
+	CRTSPClient client;
+	if(!client.run_replay(path, on_frame, &roundtrip))
+	{
+		fprintf(stderr, "run_replay refused \"%s\"\n", path);
+		return 1;
+	}
+	DWORD start = GetTickCount();
+	while(!client.replay_finished() && GetTickCount() - start < ROUNDTRIP_TIMEOUT_MS) Sleep(10);
+	bool finished = client.replay_finished();
+	SLive_RtspFrameStats stats;
+	client.get_frame_stats(stats);
+	client.stop();
+	DeleteFileA(path);
+	delete crypto;
+	delete mikey;
+
+	printf("%u frames replayed in %lu ms, %u bad\n", (unsigned)roundtrip.next, GetTickCount() - start, roundtrip.bad_frames);
+	if(srtp && !stats.secure)
+	{
+		fprintf(stderr, "FAILED: the SRTP session is not reported as secure\n");
+		return 1;
+	}
+	if(!finished)
+	{
+		fprintf(stderr, "the replay did not finish within %d ms\n", ROUNDTRIP_TIMEOUT_MS);
+		return 1;
+	}
+	if(roundtrip.next != roundtrip.expected.size() || 0 != roundtrip.bad_frames)
+	{
+		fprintf(stderr, "FAILED: %u of %u frames came back, %u bad\n", (unsigned)roundtrip.next, (unsigned)roundtrip.expected.size(),
+			roundtrip.bad_frames);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
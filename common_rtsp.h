@@ -59,17 +59,250 @@ typedef struct ELive_AudioParam
 	}
 }ELive_AudioParam;
 
+typedef enum ELive_RtspFrameIntegrity
+{
+	LIVE_FRAME_COMPLETE = 0,
+	LIVE_FRAME_DAMAGED,				//RTP packets were lost right before / inside this frame, or it was truncated
+	LIVE_FRAME_DEPENDS_ON_DAMAGED	//intact itself, but predicted from a damaged frame (video, until the next IDR)
+}ELive_RtspFrameIntegrity;
+
 typedef struct SLive_RtspDataInfo
 {
 	ELive_RtspDataType data_type;					//
 	ELive_VideoParam video_param;
 	ELive_AudioParam audio_param;
+	ELive_RtspFrameIntegrity integrity;
 
 	SLive_RtspDataInfo()
 	{
 		data_type = LIVE_RTSP_DATA_TYPE_INVALID;
+		integrity = LIVE_FRAME_COMPLETE;
 	}
 
 }SLive_RtspDataInfo;
 
-typedef void (__stdcall *rtsp_data_callback)(unsigned char* data, int data_len, SLive_RtspDataInfo data_info, void* user_param);
\ No newline at end of file
+typedef void (__stdcall *rtsp_data_callback)(unsigned char* data, int data_len, SLive_RtspDataInfo data_info, void* user_param);
+
+typedef enum ELive_RtspLogLevel
+{
+	LIVE_LOG_LEVEL_OFF = 0,
+	LIVE_LOG_LEVEL_ERROR,
+	LIVE_LOG_LEVEL_WARN,
+	LIVE_LOG_LEVEL_INFO,
+	LIVE_LOG_LEVEL_DEBUG			//also turns on live555's own RTSP protocol dump
+}ELive_RtspLogLevel;
+
+typedef enum ELive_RtspPhase
+{
+	LIVE_PHASE_CONNECT = 0,
+	LIVE_PHASE_DESCRIBE,
+	LIVE_PHASE_SETUP,
+	LIVE_PHASE_PLAY,
+	LIVE_PHASE_STREAMING,
+	LIVE_PHASE_TEARDOWN
+}ELive_RtspPhase;
+
+typedef struct SLive_RtspLogRecord
+{
+	ELive_RtspLogLevel level;
+	unsigned stream_id;
+	unsigned url_hash;				//FNV-1a of the url, so credentials in the url never reach the log
+	ELive_RtspPhase phase;
+	int result_code;				//RTSP/live555 result code, 0 on success
+	unsigned __int64 timestamp_us;	//wall clock, microseconds since 1970
+	const char* message;
+}SLive_RtspLogRecord;
+
+/* called on the background log flush thread, never on a stream's event loop thread */
+typedef void (__stdcall *rtsp_log_callback)(const SLive_RtspLogRecord* record, void* user_param);
+
+typedef enum ELive_RtspPriority
+{
+	LIVE_PRIORITY_LIVE = 0,			//live view, admitted first
+	LIVE_PRIORITY_RECORD,
+	LIVE_PRIORITY_BACKFILL,			//recording backfill / archive download
+	LIVE_PRIORITY_COUNT
+}ELive_RtspPriority;
+
+typedef struct SLive_RtspAdmissionConfig
+{
+	int max_handshakes;				//concurrent DESCRIBE..PLAY exchanges in the process, 0 = unlimited
+	int max_handshakes_per_host;	//same, per "host:port" of the url, 0 = unlimited
+	double handshakes_per_second;	//token bucket refill rate, 0 = no pacing
+	int burst;						//token bucket depth, at least 1 (smaller values are raised to 1)
+	int jitter_ms;					//random delay after admission, spreads the connects of one burst
+	int handshake_timeout_ms;		//a slot held longer than this is given back to the queue
+
+	SLive_RtspAdmissionConfig()
+	{
+		max_handshakes = 64;
+		max_handshakes_per_host = 4;
+		handshakes_per_second = 100.0;
+		burst = 20;
+		jitter_ms = 50;
+		handshake_timeout_ms = 10000;
+	}
+}SLive_RtspAdmissionConfig;
+
+typedef struct SLive_RtspStartupTiming
+{
+	ELive_RtspPriority priority;
+	int queue_ms;					//time spent waiting for admission, -1 while queued
+	int handshake_ms;				//DESCRIBE sent to PLAY answered, -1 while in progress
+
+	SLive_RtspStartupTiming()
+	{
+		priority = LIVE_PRIORITY_LIVE;
+		queue_ms = -1;
+		handshake_ms = -1;
+	}
+}SLive_RtspStartupTiming;
+
+typedef struct SLive_RtspPlacement
+{
+	unsigned short cpu_group;		//processor group cpu_mask refers to (machines with more than 64 logical processors)
+	unsigned __int64 cpu_mask;		//CPUs the event loop thread may run on, 0 = leave it to the OS
+	int numa_node;					//node the receive buffers are allocated on, -1 = node the loop thread ends up on
+
+	SLive_RtspPlacement()
+	{
+		cpu_group = 0;
+		cpu_mask = 0;
+		numa_node = -1;
+	}
+}SLive_RtspPlacement;
+
+typedef struct SLive_RtspFrameStats
+{
+	unsigned __int64 frames;			//frames delivered by live555 to our sinks
+	unsigned __int64 bytes;
+	unsigned __int64 truncated_frames;	//frames larger than the receive buffer
+	unsigned __int64 queue_full_frames;	//pull mode: frames dropped because the consumer held every slot
+	unsigned __int64 damaged_frames;
+	unsigned __int64 dependent_frames;	//LIVE_FRAME_DEPENDS_ON_DAMAGED
+	unsigned __int64 skipped_frames;	//not delivered because of SLive_RtspLossPolicy::skip_until_keyframe
+	unsigned __int64 keyframe_requests;	//RTCP PLI / FIR sent
+	unsigned __int64 dispatch_ns;		//total time from frame arrival to callback return, RTSP_CLIENT_FRAME_TIMING builds only
+	unsigned __int64 max_dispatch_ns;
+	unsigned __int64 stalls;			//SLive_RtspWatchdog::stall_timeout_ms without media
+	unsigned __int64 reconnects;
+	bool secure;						//rtsps:// or SRTP protected media
+	unsigned __int64 loop_cpu_us;		//total CPU time of the stream's event loop thread (socket reads, TLS, SRTP, depacketizing and the
+										//callback), refreshed once per second.  Not a crypto measurement: the crypto share per Mbit can only be
+										//estimated by comparing loop_cpu_us / (bytes * 8 / 1e6) of a secure and a plain stream of the same media
+
+	SLive_RtspFrameStats()
+	{
+		frames = 0;
+		bytes = 0;
+		truncated_frames = 0;
+		queue_full_frames = 0;
+		damaged_frames = 0;
+		dependent_frames = 0;
+		skipped_frames = 0;
+		keyframe_requests = 0;
+		dispatch_ns = 0;
+		max_dispatch_ns = 0;
+		stalls = 0;
+		reconnects = 0;
+		secure = false;
+		loop_cpu_us = 0;
+	}
+}SLive_RtspFrameStats;
+
+typedef struct SLive_RtspFrame
+{
+	unsigned char* data;			//points into the receive slot the frame was written to, valid until release_frame()
+	int data_len;
+	SLive_RtspDataInfo data_info;
+	int slot;
+
+	SLive_RtspFrame()
+	{
+		data = NULL;
+		data_len = 0;
+		slot = -1;
+	}
+}SLive_RtspFrame;
+
+typedef struct SLive_RtspLossPolicy
+{
+	bool skip_until_keyframe;			//don't deliver damaged / dependent video frames, resume at the next IDR
+	bool request_keyframe;				//send RTCP PLI (or FIR) when video gets damaged, if the SDP offers rtcp-fb pli / ccm fir
+	bool force_keyframe_request;		//send PLI even if the SDP doesn't offer it
+	int keyframe_request_interval_ms;	//at most one request per interval, repeated every interval until the key frame arrives
+
+	SLive_RtspLossPolicy()
+	{
+		skip_until_keyframe = false;
+		request_keyframe = false;
+		force_keyframe_request = false;
+		keyframe_request_interval_ms = 1000;
+	}
+}SLive_RtspLossPolicy;
+
+typedef struct SLive_RtspArchiveParam
+{
+	bool enabled;
+	float speed;						//PLAY "Speed:", > 0, e.g. 8.0; 1.0 = real time.  "Scale:" stays 1: NVRs answer Scale > 1 with trick play
+										//(often key frames only), which is not an export
+	bool no_rate_control;				//"Rate-Control: no" (ONVIF replay): the server sends as fast as it can
+	double start;						//requested range in npt seconds, end <= 0 = to the end of the recording
+	double end;
+	char start_time[32];				//or an absolute range "YYYYMMDDTHHMMSSZ" (takes precedence when set)
+	char end_time[32];
+	int receive_buffer_size;			//socket receive buffer, bytes
+
+	SLive_RtspArchiveParam()
+	{
+		enabled = false;
+		speed = 1.0f;
+		no_rate_control = true;
+		start = 0.0;
+		end = 0.0;
+		start_time[0] = '\0';
+		end_time[0] = '\0';
+		receive_buffer_size = 8*1024*1024;
+	}
+}SLive_RtspArchiveParam;
+
+typedef struct SLive_RtspArchiveProgress
+{
+	double position;					//seconds of the requested range received so far, from the frames' presentation times; a
+										//reconnect resumes the download from here
+	double duration;					//length of the requested range, 0 = unknown
+	bool finished;						//the server ended the stream (RTCP BYE / end of the recording)
+
+	SLive_RtspArchiveProgress()
+	{
+		position = 0.0;
+		duration = 0.0;
+		finished = false;
+	}
+}SLive_RtspArchiveProgress;
+
+/* stream_id as returned by CRTSPClient::stream_id(); stalled = false when media comes back (after a reconnect too), silent_ms is
+ * then how long the stall lasted */
+typedef void (__stdcall *rtsp_stall_callback)(unsigned stream_id, bool stalled, int silent_ms, void* user_param);
+
+typedef struct SLive_RtspWatchdog
+{
+	int stall_timeout_ms;				//no media for this long = stalled, counted from the connect, so a stuck handshake is one too; 0 = no watchdog
+	int keepalive_interval_ms;			//GET_PARAMETER (OPTIONS if the server refuses it), 0 = half the session timeout, -1 = none
+	bool reconnect;						//re-open the stream after a stall, or when it ends or fails without stop()
+	int reconnect_min_ms;				//backoff doubles from min up to max, and starts over once media arrives
+	int reconnect_max_ms;
+	rtsp_stall_callback stall_cb;		//called on the event loop thread
+	void* stall_cb_user;
+
+	SLive_RtspWatchdog()
+	{
+		stall_timeout_ms = 5000;
+		keepalive_interval_ms = 0;
+		reconnect = false;
+		reconnect_min_ms = 1000;
+		reconnect_max_ms = 30000;
+		stall_cb = NULL;
+		stall_cb_user = NULL;
+	}
+}SLive_RtspWatchdog;
\ No newline at end of file
@@ -1,9 +1,18 @@
 #include <process.h>
+#include <stdarg.h>
 
 #include "liveMedia.hh"
 #include "BasicUsageEnvironment.hh"
+#include "GroupsockHelper.hh"
 
 #include "parse_rtsp.h"
+#include "rtsp_log.h"
+#include "rtsp_admission.h"
+#include "rtsp_placement.h"
+#include "rtsp_frame.h"
+#include "rtsp_frame_queue.h"
+#include "rtsp_timer_wheel.h"
+#include "rtsp_capture.h"
 
 // Forward function definitions:
 
@@ -11,21 +20,35 @@
 void continueAfterDESCRIBE(RTSPClient* rtspClient, int resultCode, char* resultString);
 void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultString);
 void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultString);
+void continueAfterKeepAlive(RTSPClient* rtspClient, int resultCode, char* resultString);
 
 // Other event handler functions:
 void subsessionAfterPlaying(void* clientData); // called when a stream's subsession (e.g., audio or video substream) ends
 void subsessionByeHandler(void* clientData); // called when a RTCP "BYE" is received for a subsession
 void streamTimerHandler(void* clientData);
 // called at the end of a stream's expected duration (if the stream has not already signaled its end using a RTCP "BYE")
+void keepAliveHandler(void* clientData); // sends a GET_PARAMETER (or OPTIONS) so that the server keeps our session
+void streamWatchdogHandler(void* clientData); // checks whether media is still arriving
+void streamMediaArrived(RTSPClient* rtspClient); // the first frame of a client, or the first one after a stall
+void reconnectHandler(void* clientData); // opens a new "RTSPClient" after the previous one went away
+void admissionGranted(void* clientData); // called by the admission controller, on any thread: wakes the loop up
+void admissionHandler(void* clientData); // checks (again) whether the stream has been admitted
+void connectHandler(void* clientData); // connects once admitted (and after the jitter)
 
 // The main streaming routine (for each "rtsp://" URL):
 void openURL(UsageEnvironment& env, char const* progName, char const* rtspURL);
 
 // Used to iterate through each stream's 'subsessions', setting up each one:
 void setupNextSubsession(RTSPClient* rtspClient);
+Boolean startSubsessionSink(RTSPClient* rtspClient, MediaSubsession* subsession);
 
-// Used to shut down and close a stream (including its "RTSPClient" object):
-void shutdownStream(RTSPClient* rtspClient, int exitCode = 1);
+// Capture mode (see rtsp_capture.h):
+unsigned subsessionIndex(MediaSubsession& subsession); // the position of its "m=" section in the SDP
+void captureRtspResult(RTSPClient* rtspClient, char const* command, int resultCode, unsigned subsession, char const* fmt, ...);
+
+// Used to shut down and close a stream (including its "RTSPClient" object);
+// "resultCode" is why: 0, a RTSP status or -errno from live555, or -1 for a local failure:
+void shutdownStream(RTSPClient* rtspClient, int resultCode);
 
 // A function that outputs a string that identifies each stream (for debugging output).  Modify this if you wish:
 UsageEnvironment& operator<<(UsageEnvironment& env, const RTSPClient& rtspClient) {
@@ -75,6 +98,10 @@ void usage(UsageEnvironment& env, char const* progName) {
 //  */
 //}
 
+class StreamLoopState;
+class StreamReplayState;
+struct RTSPClientThreadParam_S;
+
 // Define a class to hold per-stream state that we maintain throughout each stream's lifetime:
 
 class StreamClientState {
@@ -86,7 +113,7 @@ public:
 	MediaSubsessionIterator* iter;
 	MediaSession* session;
 	MediaSubsession* subsession;
-	TaskToken streamTimerTask;
+	SRtspTimer streamTimer; // on the loop's timer wheel
 	double duration;
 };
 
@@ -104,7 +131,6 @@ public:
 
 	void set_rtsp_param(  rtsp_data_callback rtsp_data_cb,
 		void* rtsp_data_cb_user,
-		bool *is_need_shutdown_stream,
 		CClientMutex *mutex);
 
 protected:
@@ -113,17 +139,153 @@ protected:
 	// called only by createNew();
 	virtual ~ourRTSPClient();
 
+	// redefined virtual functions:
+	virtual Boolean setRequestFields(RequestRecord* request,
+		char*& cmdURL, Boolean& cmdURLWasAllocated,
+		char const*& protocolStr,
+		char*& extraHeaders, Boolean& extraHeadersWereAllocated);
+
 public:
 	StreamClientState scs;
 
 	rtsp_data_callback rtsp_data_cb_;
 	void* rtsp_data_cb_user_;
-	bool *is_need_shutdown_stream_;
 	CClientMutex *mutex_;
 
-	bool has_audio_stream_;
+	volatile LONG* has_audio_stream_; // CRTSPClient's flag, read by has_audio_stream() without taking the loop's lock
+	StreamLoopState* loop_;
+	CRtspLogStream* log_;
+
+	// Startup admission: the handshake slot is held from DESCRIBE until PLAY has been answered:
+	void finish_handshake();
+
+	SRtspAdmissionTicket* admission_ticket_;
+	SLive_RtspStartupTiming* startup_timing_;
+	DWORD handshake_tick_;
+
+	int numa_node_; // node our sinks allocate their receive buffers on, -1 = unknown
+	SLive_RtspFrameStats* frame_stats_;
+	CRtspFrameQueue* frame_queue_; // receive slots shared by our sinks, delivers to the callback or the pull consumer
+
+	SLive_RtspLossPolicy loss_policy_;
+	Boolean streaming_over_tcp_;
+
+	SLive_RtspArchiveParam archive_param_; // bulk download of a recording, see CRTSPClient::set_archive_mode()
+	SLive_RtspArchiveProgress* archive_progress_; // we write it under "archive_mutex_", the user reads it from another thread
+	CClientMutex* archive_mutex_;
+	double archive_resume_; // media time the connections before us delivered: our PLAY starts that far into the range
+
+	// Session timers, on the loop's timer wheel.  The sinks store the wheel's time of every frame into "last_media_tick_":
+	SRtspTimer keepalive_timer_;
+	int keepalive_ms_;
+	Boolean keepalive_get_parameter_; // False once the server has refused GET_PARAMETER
+	SRtspTimer watchdog_timer_; // from the connect on: a handshake that doesn't get to media is a stall too
+	unsigned __int64 last_media_tick_;
+	Boolean media_seen_; // a frame has come since we connected
+
+	Boolean replaying_; // fed from a capture file, there is no server to talk to
+};
+
+// State of one stream's event loop.  It lives as long as the loop thread, so it outlives the "ourRTSPClient"s
+// that a reconnecting stream goes through:
+
+class StreamLoopState {
+public:
+	StreamLoopState(UsageEnvironment& env, RTSPClientThreadParam_S* threadParam, CRtspLogStream* log, int numaNode);
+	virtual ~StreamLoopState();
+
+	void openClient(); // queues for startup admission; "connectClient()" follows once admitted
+	Boolean openReplay(); // a "ourRTSPClient" fed from the capture file instead
+	void clientClosed(ourRTSPClient* rtspClient);
+	void scheduleReconnect();
+
+	void pollAdmission();
+	void connectClient(); // a new "ourRTSPClient" and its "DESCRIBE"
+
+private:
+	ourRTSPClient* createClient();
+
+public:
+	UsageEnvironment& env;
+	RTSPClientThreadParam_S* threadParam;
+	CRtspLogStream* log;
+	int numaNode;
+	SLive_RtspWatchdog watchdog;
+	SLive_RtspFrameStats* frameStats;
+	CRtspTimerWheel timerWheel;
+	ourRTSPClient* client; // NULL while waiting to reconnect
+	SRtspTimer reconnectTimer;
+	int reconnectAttempts; // since media last arrived
+	Boolean stalled; // kept across reconnects, so that the client that gets media again reports the recovery
+	unsigned __int64 stallTick; // the wheel's time of the last media before the stall
+	Boolean stopping;
+	SRtspAdmissionTicket* admissionTicket; // from queueing for admission until the client takes it over
+	Boolean admitted; // ... and waiting out the jitter
+	DWORD admissionQueueTick;
+	EventTriggerId admissionTrigger;
+	TaskToken admissionTask; // the next poll, or the connect after the jitter
+	CRtspCaptureWriter capture; // capture mode only
+	StreamReplayState* replay; // replay mode only
+};
+
+// Replay of a capture file.  The subsessions of the captured SDP are initiated locally (there is no "SETUP"), and the
+// captured RTP packets are fed to their RTP sources interleaved on a loopback TCP connection, exactly as "RTP over
+// RTSP" would deliver them.  TCP neither drops nor reorders, and its flow control paces us at the speed the loop reads,
+// so replaying as fast as possible delivers every packet.  One delayed task does the sending; it either keeps the
+// original timing, or goes on whenever the connection has room again:
+
+#define RTSP_REPLAY_URL "rtsp://127.0.0.1/replay" // only names the stream in the log
+#define RTSP_REPLAY_MAX_SUBSESSIONS 16 // two interleaved channels each (RTP, RTCP)
+#define RTSP_REPLAY_BATCH 64 // packets sent per task, so that the sinks get to run in between
+#define RTSP_REPLAY_STALL_MS 1000 // after the last packet, how long to wait for the loop to have read all of them
+
+class StreamReplayState {
+public:
+	StreamReplayState(StreamLoopState& loop, Boolean originalTiming);
+	virtual ~StreamReplayState();
+
+	Boolean start(ourRTSPClient* rtspClient, char const* sdpDescription);
+
+private:
+	static void pumpHandler(void* clientData);
+	void pump();
+	Boolean nextPacket();
+	int sendPacket();
+	static void socketHandler(void* clientData, int mask);
+	void finish();
+
+	static void countRTPPacket(void* clientData, unsigned char* packet, unsigned& packetSize);
+
+public:
+	CRtspCaptureReader reader;
+
+private:
+	StreamLoopState& fLoop;
+	Boolean fOriginalTiming;
+	ourRTSPClient* fClient;
+	SOCKET fSocket; // our end of the connection
+	SOCKET fClientSocket; // the end the RTP sources read from
+	Boolean fReplayed[RTSP_REPLAY_MAX_SUBSESSIONS]; // by subsession index
+	TaskToken fPumpTask;
+	Boolean fBlocked; // the connection is full, waiting for it to become writable
+
+	SRtspCaptureRecord fRecord; // the next packet to send, when "fHavePacket"
+	const unsigned char* fPayload;
+	Boolean fHavePacket;
+	unsigned fSendOffset; // how much of it (with its 4 byte interleaving header) is sent already
+	Boolean fHaveFirstArrival;
+	unsigned __int64 fFirstArrivalUs;
+	unsigned __int64 fStartUs;
+
+	unsigned fSent;
+	unsigned fReceived;
+	DWORD fProgressTick; // when a packet was last read back
 };
 
+// Log through the stream's asynchronous log handle; nothing is formatted when the level is disabled:
+#define CLIENT_LOG(rtspClient, level, phase, result_code, ...) \
+	RTSP_LOG(((ourRTSPClient*)(rtspClient))->log_, level, phase, result_code, __VA_ARGS__)
+
 // Define a data sink (a subclass of "MediaSink") to receive the data for each subsession (i.e., each audio or video 'substream').
 // In practice, this might be a class (or a chain of classes) that decodes and then renders the incoming audio or video.
 // Or it might be a "FileSink", for outputting the received data into a file (as is done by the "openRTSP" application).
@@ -133,15 +295,26 @@ class DummySink: public MediaSink {
 public:
 	static DummySink* createNew(UsageEnvironment& env,
 		MediaSubsession& subsession, // identifies the kind of data that's being received
-		char const* streamId = NULL); // identifies the stream itself (optional)
+		char const* streamId = NULL, // identifies the stream itself (optional)
+		int numaNode = -1); // NUMA node to allocate the receive buffer on (optional)
 
 	void set_rtsp_param(  rtsp_data_callback rtsp_data_cb,
 		void* rtsp_data_cb_user,
-		bool *is_need_shutdown_stream_,
 		CClientMutex *mutex);
 
+	void set_frame_stats(SLive_RtspFrameStats* frame_stats) {frame_stats_ = frame_stats;}
+	void set_frame_queue(CRtspFrameQueue* frame_queue) {frame_queue_ = frame_queue;}
+	void set_loss_policy(const SLive_RtspLossPolicy& loss_policy, ERtspKeyframeFeedback keyframe_feedback, Boolean rtcp_reduced_size,
+		Boolean streaming_over_tcp, Boolean srtp);
+	void set_archive_progress(SLive_RtspArchiveProgress* archive_progress, CClientMutex* archive_mutex, double archive_base)
+		{archive_progress_ = archive_progress; archive_mutex_ = archive_mutex; archive_base_ = archive_base;}
+	void set_media_clock(CRtspTimerWheel* timer_wheel, ourRTSPClient* media_client) {timer_wheel_ = timer_wheel; media_client_ = media_client;}
+	void set_capture(CRtspCaptureWriter* capture, unsigned subsessionIndex);
+	// Also shows every RTP packet of the subsession to "observer" (live555 has room for one read handler only, which is ours):
+	void set_read_observer(RTPSource::AuxHandlerFunc* observer, void* observerClientData) {read_observer_ = observer; read_observer_data_ = observerClientData;}
+
 private:
-	DummySink(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId);
+	DummySink(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId, int numaNode);
 	// called only by "createNew()"
 	virtual ~DummySink();
 
@@ -152,23 +325,56 @@ private:
 	void afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes,
 	struct timeval presentationTime, unsigned durationInMicroseconds);
 
+	void requestKeyFrame();
+
+	static void packetRead(void* clientData, unsigned char* packet, unsigned& packetSize);
+
 private:
 	// redefined virtual functions:
 	virtual Boolean continuePlaying();
 
 private:
-	u_int8_t* fReceiveBuffer;
+	u_int8_t* fReceiveBuffer; // the slot (or scratch buffer) the current frame is being received into
+	int fSlot; // -1 while receiving into the scratch buffer
+	u_int8_t* fScratchBuffer; // only allocated once a frame finds no free slot
+	int fNumaNode;
 	MediaSubsession& fSubsession;
 	char* fStreamId;
 
 	rtsp_data_callback rtsp_data_cb_;
 	void* rtsp_data_cb_user_;
-	bool *is_need_shutdown_stream_;
 	CClientMutex *mutex_;
 
+	ERtspSinkCodec codec_;
+	SLive_RtspDataInfo frame_info_;	// metadata shared by all frames of the subsession, see rtsp_frame_info_template()
+	SLive_RtspFrameStats* frame_stats_;
+	CRtspFrameQueue* frame_queue_;
+
+	SLive_RtspLossPolicy loss_policy_;
+	SRtspIntegrityState integrity_state_;
+	SRtspSeqTracker seq_tracker_; // which RTP packets have been read, see rtsp_seq_frame_lost()
+	ERtspKeyframeFeedback keyframe_feedback_; // what the server's SDP says it accepts for our payload type
+	Boolean rtcp_reduced_size_;
+	Boolean streaming_over_tcp_;
+	Boolean srtp_; // RTP/SAVP(F): the subsession's RTCP is SRTCP
+	DWORD last_keyframe_request_tick_;
+	u_int8_t fir_seq_;
+
+	SLive_RtspArchiveProgress* archive_progress_; // NULL unless downloading a recording
+	CClientMutex* archive_mutex_;
+	double archive_base_; // where in the range our PLAY started
+	SRtspArchiveClock archive_clock_;
+
+	CRtspTimerWheel* timer_wheel_;
+	ourRTSPClient* media_client_; // we keep its "last_media_tick_" for the stream watchdog
+
+	CRtspCaptureWriter* capture_; // capture mode only
+	unsigned capture_subsession_;
+	RTPSource::AuxHandlerFunc* read_observer_;
+	void* read_observer_data_;
 };
 
-#define RTSP_CLIENT_VERBOSITY_LEVEL 1 // by default, print verbose output from each "RTSPClient"
+#define RTSP_CLIENT_VERBOSITY_LEVEL 0 // live555's own (synchronous) protocol dump; enabled per stream by LIVE_LOG_LEVEL_DEBUG
 
 static unsigned rtspClientCount = 0; // Counts how many streams (i.e., "RTSPClient"s) are currently in use.
 
@@ -193,27 +399,45 @@ void openURL(UsageEnvironment& env, char const* progName, char const* rtspURL) {
 // Implementation of the RTSP 'response handlers':
 
 void continueAfterDESCRIBE(RTSPClient* rtspClient, int resultCode, char* resultString) {
+	int failureCode = resultCode != 0 ? resultCode : -1;
+
 	do {
 		UsageEnvironment& env = rtspClient->envir(); // alias
 		StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
 
 		if (resultCode != 0) {
-			env << *rtspClient << "Failed to get a SDP description: " << resultString << "\n";
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_DESCRIBE, resultCode, "Failed to get a SDP description: %s", resultString);
+			captureRtspResult(rtspClient, "DESCRIBE", resultCode, 0, "%s", resultString != NULL ? resultString : "");
 			delete[] resultString;
 			break;
 		}
 
 		char* const sdpDescription = resultString;
-		env << *rtspClient << "Got a SDP description:\n" << sdpDescription << "\n";
+		RTSP_LOG_TEXT(((ourRTSPClient*)rtspClient)->log_, LIVE_LOG_LEVEL_DEBUG, LIVE_PHASE_DESCRIBE, 0, "Got a SDP description", sdpDescription);
+		if (((ourRTSPClient*)rtspClient)->loop_->capture.is_open()) {
+			((ourRTSPClient*)rtspClient)->loop_->capture.write(RTSP_CAPTURE_SDP, 0, sdpDescription, (unsigned)strlen(sdpDescription));
+		}
+
+		// SRTP is decrypted inside live555 (OpenSSL, which picks AES-NI/CLMUL on its own), provided the keys came by MIKEY:
+		ERtspSrtpKeying srtpKeying = rtsp_sdp_srtp_keying(sdpDescription);
+		if (srtpKeying == RTSP_SRTP_KEYING_UNSUPPORTED) {
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_DESCRIBE, 0,
+				"The media is SRTP protected without MIKEY key management (\"a=key-mgmt:mikey\"); it cannot be decrypted");
+		}
+		if (((ourRTSPClient*)rtspClient)->frame_stats_ != NULL) {
+			((ourRTSPClient*)rtspClient)->frame_stats_->secure = srtpKeying != RTSP_SRTP_KEYING_NONE
+				|| _strnicmp(rtspClient->url(), "rtsps://", 8) == 0;
+		}
 
 		// Create a media session object from this SDP description:
 		scs.session = MediaSession::createNew(env, sdpDescription);
 		delete[] sdpDescription; // because we don't need it anymore
 		if (scs.session == NULL) {
-			env << *rtspClient << "Failed to create a MediaSession object from the SDP description: " << env.getResultMsg() << "\n";
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_DESCRIBE, -1,
+				"Failed to create a MediaSession object from the SDP description: %s", env.getResultMsg());
 			break;
 		} else if (!scs.session->hasSubsessions()) {
-			env << *rtspClient << "This session has no media subsessions (i.e., no \"m=\" lines)\n";
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_DESCRIBE, -1, "This session has no media subsessions (i.e., no \"m=\" lines)");
 			break;
 		}
 
@@ -226,7 +450,7 @@ void continueAfterDESCRIBE(RTSPClient* rtspClient, int resultCode, char* resultS
 	} while (0);
 
 	// An unrecoverable error occurred with this stream.
-	shutdownStream(rtspClient);
+	shutdownStream(rtspClient, failureCode);
 }
 
 // By default, we request that the server stream its data using RTP/UDP.
@@ -240,28 +464,61 @@ void setupNextSubsession(RTSPClient* rtspClient) {
 	scs.subsession = scs.iter->next();
 	if (scs.subsession != NULL) {
 		if (!scs.subsession->initiate()) {
-			env << *rtspClient << "Failed to initiate the \"" << *scs.subsession << "\" subsession: " << env.getResultMsg() << "\n";
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_SETUP, -1, "Failed to initiate the \"%s/%s\" subsession: %s",
+				scs.subsession->mediumName(), scs.subsession->codecName(), env.getResultMsg());
 			setupNextSubsession(rtspClient); // give up on this subsession; go to the next one
 		} else {
-			env << *rtspClient << "Initiated the \"" << *scs.subsession << "\" subsession (";
-			if (scs.subsession->rtcpIsMuxed()) {
-				env << "client port " << scs.subsession->clientPortNum();
-			} else {
-				env << "client ports " << scs.subsession->clientPortNum() << "-" << scs.subsession->clientPortNum()+1;
-			}
-			env << ")\n";
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_SETUP, 0, "Initiated the \"%s/%s\" subsession (client port %u%s)",
+				scs.subsession->mediumName(), scs.subsession->codecName(), scs.subsession->clientPortNum(),
+				scs.subsession->rtcpIsMuxed() ? "" : ", rtcp on the next port");
 
 			if(!strcmp(scs.subsession->mediumName(), "audio"))
-				((ourRTSPClient*)rtspClient)->has_audio_stream_ = true; 
+				InterlockedExchange(((ourRTSPClient*)rtspClient)->has_audio_stream_, 1);
 
 			// Continue setting up this subsession, by sending a RTSP "SETUP" command:
-			rtspClient->sendSetupCommand(*scs.subsession, continueAfterSETUP, False, REQUEST_STREAMING_OVER_TCP);
+			rtspClient->sendSetupCommand(*scs.subsession, continueAfterSETUP, False, ((ourRTSPClient*)rtspClient)->streaming_over_tcp_);
 		}
 		return;
 	}
 
 	// We've finished setting up all of the subsessions.  Now, send a RTSP "PLAY" command to start the streaming:
-	if (scs.session->absStartTime() != NULL) {
+	SLive_RtspArchiveParam& archive = ((ourRTSPClient*)rtspClient)->archive_param_; // alias
+	if (archive.enabled) {
+		// Bulk download of the requested range, at the requested speed ("Speed:" and "Rate-Control:" are added by setRequestFields();
+		// "Scale:" stays at 1, so that we get every frame rather than trick play).
+		// Everything will arrive interleaved on the RTSP connection; give the kernel room for bursts the loop can't drain right away,
+		// before the first of them comes in:
+		unsigned bufferSize = increaseReceiveBufferTo(rtspClient->envir(), rtspClient->socketNum(), archive.receive_buffer_size);
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_DEBUG, LIVE_PHASE_PLAY, 0, "Receive buffer of the RTSP connection: %u bytes", bufferSize);
+
+		// Without an explicit range, take the server's 'absolute' range if it has one.  After a reconnect, the range starts where
+		// the previous connections got to (the server starts from the key frame before that, so up to a GOP comes again):
+		SLive_RtspArchiveProgress* progress = ((ourRTSPClient*)rtspClient)->archive_progress_;
+		double resume = ((ourRTSPClient*)rtspClient)->archive_resume_;
+		double duration;
+		char resumeTime[32];
+		char const* absStartTime = archive.start_time[0] != '\0' ? archive.start_time
+			: (archive.start <= 0 && archive.end <= 0 ? scs.session->absStartTime() : NULL);
+		if (absStartTime != NULL) {
+			char const* absEndTime = archive.start_time[0] != '\0' ? archive.end_time : scs.session->absEndTime();
+			if (absEndTime != NULL && absEndTime[0] == '\0') absEndTime = NULL;
+
+			duration = absEndTime != NULL ? rtsp_abs_time_diff(absStartTime, absEndTime) : 0.0;
+			if (resume > 0 && rtsp_abs_time_add(absStartTime, resume, resumeTime, sizeof(resumeTime))) absStartTime = resumeTime;
+			rtspClient->sendPlayCommand(*scs.session, continueAfterPLAY, absStartTime, absEndTime);
+		} else {
+			double end = archive.end > 0 ? archive.end : scs.session->playEndTime();
+			duration = end > archive.start ? end - archive.start : 0.0;
+			rtspClient->sendPlayCommand(*scs.session, continueAfterPLAY, archive.start + resume, archive.end > 0 ? archive.end : -1.0f);
+		}
+		if (resume > 0) {
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_PLAY, 0, "Resuming the download %.1f seconds into the range", resume);
+		}
+
+		((ourRTSPClient*)rtspClient)->archive_mutex_->get_mutex();
+		progress->duration = duration;
+		((ourRTSPClient*)rtspClient)->archive_mutex_->release_mutex();
+	} else if (scs.session->absStartTime() != NULL) {
 		// Special case: The stream is indexed by 'absolute' time, so send an appropriate "PLAY" command:
 		rtspClient->sendPlayCommand(*scs.session, continueAfterPLAY, scs.session->absStartTime(), scs.session->absEndTime());
 	} else {
@@ -272,44 +529,25 @@ void setupNextSubsession(RTSPClient* rtspClient) {
 
 void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultString) {
 	do {
-		UsageEnvironment& env = rtspClient->envir(); // alias
 		StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
 
 		if (resultCode != 0) {
-			env << *rtspClient << "Failed to set up the \"" << *scs.subsession << "\" subsession: " << resultString << "\n";
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_SETUP, resultCode, "Failed to set up the \"%s/%s\" subsession: %s",
+				scs.subsession->mediumName(), scs.subsession->codecName(), resultString);
 			break;
 		}
 
-		env << *rtspClient << "Set up the \"" << *scs.subsession << "\" subsession (";
-		if (scs.subsession->rtcpIsMuxed()) {
-			env << "client port " << scs.subsession->clientPortNum();
-		} else {
-			env << "client ports " << scs.subsession->clientPortNum() << "-" << scs.subsession->clientPortNum()+1;
-		}
-		env << ")\n";
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_SETUP, 0, "Set up the \"%s/%s\" subsession (client port %u%s)",
+			scs.subsession->mediumName(), scs.subsession->codecName(), scs.subsession->clientPortNum(),
+			scs.subsession->rtcpIsMuxed() ? "" : ", rtcp on the next port");
+		captureRtspResult(rtspClient, "SETUP", resultCode, subsessionIndex(*scs.subsession), "%s/%s client_port=%u server_port=%u",
+			scs.subsession->mediumName(), scs.subsession->codecName(), scs.subsession->clientPortNum(), scs.subsession->serverPortNum);
 
 		// Having successfully setup the subsession, create a data sink for it, and call "startPlaying()" on it.
 		// (This will prepare the data sink to receive data; the actual flow of data from the client won't start happening until later,
 		// after we've sent a RTSP "PLAY" command.)
 
-		scs.subsession->sink = DummySink::createNew(env, *scs.subsession, rtspClient->url());
-		// perhaps use your own custom "MediaSink" subclass instead
-		if (scs.subsession->sink == NULL) {
-			env << *rtspClient << "Failed to create a data sink for the \"" << *scs.subsession
-				<< "\" subsession: " << env.getResultMsg() << "\n";
-			break;
-		}
-
-		((DummySink*)scs.subsession->sink)->set_rtsp_param(((ourRTSPClient*)rtspClient)->rtsp_data_cb_, ((ourRTSPClient*)rtspClient)->rtsp_data_cb_user_,
-			((ourRTSPClient*)rtspClient)->is_need_shutdown_stream_, ((ourRTSPClient*)rtspClient)->mutex_);
-		env << *rtspClient << "Created a data sink for the \"" << *scs.subsession << "\" subsession\n";
-		scs.subsession->miscPtr = rtspClient; // a hack to let subsession handler functions get the "RTSPClient" from the subsession 
-		scs.subsession->sink->startPlaying(*(scs.subsession->readSource()),
-			subsessionAfterPlaying, scs.subsession);
-		// Also set a handler to be called if a RTCP "BYE" arrives for this subsession:
-		if (scs.subsession->rtcpInstance() != NULL) {
-			scs.subsession->rtcpInstance()->setByeHandler(subsessionByeHandler, scs.subsession);
-		}
+		if (!startSubsessionSink(rtspClient, scs.subsession)) break;
 	} while (0);
 	delete[] resultString;
 
@@ -317,15 +555,58 @@ void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultStri
 	setupNextSubsession(rtspClient);
 }
 
+// Creates the data sink of a subsession whose source is ready (after its "SETUP", or initiated from a captured SDP), and starts it:
+Boolean startSubsessionSink(RTSPClient* rtspClient, MediaSubsession* subsession) {
+	UsageEnvironment& env = rtspClient->envir(); // alias
+
+	subsession->sink = DummySink::createNew(env, *subsession, rtspClient->url(), ((ourRTSPClient*)rtspClient)->numa_node_);
+	// perhaps use your own custom "MediaSink" subclass instead
+	if (subsession->sink == NULL) {
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_SETUP, -1, "Failed to create a data sink for the \"%s/%s\" subsession: %s",
+			subsession->mediumName(), subsession->codecName(), env.getResultMsg());
+		return False;
+	}
+
+	// Capture mode: record the subsession's RTP packets as live555 reads them.
+	CRtspCaptureWriter& capture = ((ourRTSPClient*)rtspClient)->loop_->capture; // alias
+	if (capture.is_open()) ((DummySink*)subsession->sink)->set_capture(&capture, subsessionIndex(*subsession));
+
+	((DummySink*)subsession->sink)->set_rtsp_param(((ourRTSPClient*)rtspClient)->rtsp_data_cb_, ((ourRTSPClient*)rtspClient)->rtsp_data_cb_user_,
+		((ourRTSPClient*)rtspClient)->mutex_);
+	((DummySink*)subsession->sink)->set_frame_stats(((ourRTSPClient*)rtspClient)->frame_stats_);
+	((DummySink*)subsession->sink)->set_frame_queue(((ourRTSPClient*)rtspClient)->frame_queue_);
+	// A replayed stream has nobody to answer a RTCP feedback message:
+	char const* mediaSDP = subsession->savedSDPLines();
+	((DummySink*)subsession->sink)->set_loss_policy(((ourRTSPClient*)rtspClient)->loss_policy_,
+		((ourRTSPClient*)rtspClient)->replaying_ ? RTSP_KEYFRAME_FEEDBACK_NONE : rtsp_sdp_keyframe_feedback(mediaSDP, subsession->rtpPayloadFormat()),
+		rtsp_sdp_rtcp_rsize(mediaSDP), ((ourRTSPClient*)rtspClient)->streaming_over_tcp_,
+		_strnicmp(subsession->protocolName(), "RTP/SAVP", 8) == 0);
+	((DummySink*)subsession->sink)->set_archive_progress(((ourRTSPClient*)rtspClient)->archive_progress_,
+		((ourRTSPClient*)rtspClient)->archive_mutex_, ((ourRTSPClient*)rtspClient)->archive_resume_);
+	((DummySink*)subsession->sink)->set_media_clock(&((ourRTSPClient*)rtspClient)->loop_->timerWheel, (ourRTSPClient*)rtspClient);
+	CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_DEBUG, LIVE_PHASE_SETUP, 0, "Created a data sink for the \"%s/%s\" subsession",
+		subsession->mediumName(), subsession->codecName());
+	subsession->miscPtr = rtspClient; // a hack to let subsession handler functions get the "RTSPClient" from the subsession 
+	subsession->sink->startPlaying(*(subsession->readSource()),
+		subsessionAfterPlaying, subsession);
+	// Also set a handler to be called if a RTCP "BYE" arrives for this subsession:
+	if (subsession->rtcpInstance() != NULL) {
+		subsession->rtcpInstance()->setByeHandler(subsessionByeHandler, subsession);
+	}
+	return True;
+}
+
 void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultString) {
 	Boolean success = False;
 
+	((ourRTSPClient*)rtspClient)->finish_handshake();
+
 	do {
-		UsageEnvironment& env = rtspClient->envir(); // alias
 		StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
 
+		captureRtspResult(rtspClient, "PLAY", resultCode, 0, "%s", resultString != NULL ? resultString : "");
 		if (resultCode != 0) {
-			env << *rtspClient << "Failed to start playing session: " << resultString << "\n";
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_PLAY, resultCode, "Failed to start playing session: %s", resultString);
 			break;
 		}
 
@@ -333,18 +614,40 @@ void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultStrin
 		// using a RTCP "BYE").  This is optional.  If, instead, you want to keep the stream active - e.g., so you can later
 		// 'seek' back within it and do another RTSP "PLAY" - then you can omit this code.
 		// (Alternatively, if you don't want to receive the entire stream, you could set this timer for some shorter value.)
-		if (scs.duration > 0) {
+		// (A bulk download runs at whatever speed the server manages, so it is left to end by itself.)
+		StreamLoopState* loop = ((ourRTSPClient*)rtspClient)->loop_; // alias
+		if (scs.duration > 0 && !((ourRTSPClient*)rtspClient)->archive_param_.enabled) {
 			unsigned const delaySlop = 2; // number of seconds extra to delay, after the stream's expected duration.  (This is optional.)
 			scs.duration += delaySlop;
-			unsigned uSecsToDelay = (unsigned)(scs.duration*1000000);
-			scs.streamTimerTask = env.taskScheduler().scheduleDelayedTask(uSecsToDelay, (TaskFunc*)streamTimerHandler, rtspClient);
+			unsigned mSecsToDelay = (unsigned)(scs.duration*1000);
+			loop->timerWheel.arm(scs.streamTimer, mSecsToDelay, streamTimerHandler, rtspClient);
+		}
+
+		// Keep the session alive; without a "Session: ...;timeout=" from the server, assume the RTSP default of 60 seconds:
+		int keepAliveMs = loop->watchdog.keepalive_interval_ms;
+		if (keepAliveMs == 0) {
+			unsigned timeout = rtspClient->sessionTimeoutParameter();
+			keepAliveMs = (timeout > 0 ? timeout : 60) * 1000 / 2;
+		}
+		if (keepAliveMs > 0) {
+			((ourRTSPClient*)rtspClient)->keepalive_ms_ = keepAliveMs;
+			loop->timerWheel.arm(((ourRTSPClient*)rtspClient)->keepalive_timer_, keepAliveMs, keepAliveHandler, rtspClient);
+		}
+
+		// Watch for media that stops arriving.  (The sinks only store a timestamp per frame; the timer checks it.)
+		if (loop->watchdog.stall_timeout_ms > 0) {
+			((ourRTSPClient*)rtspClient)->last_media_tick_ = loop->timerWheel.now();
+			loop->timerWheel.arm(((ourRTSPClient*)rtspClient)->watchdog_timer_, loop->watchdog.stall_timeout_ms, streamWatchdogHandler, rtspClient);
 		}
 
-		env << *rtspClient << "Started playing session";
-		if (scs.duration > 0) {
-			env << " (for up to " << scs.duration << " seconds)";
+		if (((ourRTSPClient*)rtspClient)->archive_param_.enabled) {
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_PLAY, 0, "Started downloading the recording at speed %.1f (%.1f seconds)...",
+				((ourRTSPClient*)rtspClient)->archive_param_.speed, ((ourRTSPClient*)rtspClient)->archive_progress_->duration);
+		} else if (scs.duration > 0) {
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_PLAY, 0, "Started playing session (for up to %.1f seconds)...", scs.duration);
+		} else {
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_PLAY, 0, "Started playing session...");
 		}
-		env << "...\n";
 
 		success = True;
 	} while (0);
@@ -352,7 +655,7 @@ void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultStrin
 
 	if (!success) {
 		// An unrecoverable error occurred with this stream.
-		shutdownStream(rtspClient);
+		shutdownStream(rtspClient, resultCode != 0 ? resultCode : -1);
 	}
 }
 
@@ -375,15 +678,20 @@ void subsessionAfterPlaying(void* clientData) {
 	}
 
 	// All subsessions' streams have now been closed, so shutdown the client:
-	shutdownStream(rtspClient);
+	if (((ourRTSPClient*)rtspClient)->archive_progress_ != NULL) {
+		((ourRTSPClient*)rtspClient)->archive_mutex_->get_mutex();
+		((ourRTSPClient*)rtspClient)->archive_progress_->finished = true;
+		((ourRTSPClient*)rtspClient)->archive_mutex_->release_mutex();
+	}
+	shutdownStream(rtspClient, 0);
 }
 
 void subsessionByeHandler(void* clientData) {
 	MediaSubsession* subsession = (MediaSubsession*)clientData;
 	RTSPClient* rtspClient = (RTSPClient*)subsession->miscPtr;
-	UsageEnvironment& env = rtspClient->envir(); // alias
 
-	env << *rtspClient << "Received RTCP \"BYE\" on \"" << *subsession << "\" subsession\n";
+	CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_STREAMING, 0, "Received RTCP \"BYE\" on \"%s/%s\" subsession",
+		subsession->mediumName(), subsession->codecName());
 
 	// Now act as if the subsession had closed:
 	subsessionAfterPlaying(subsession);
@@ -391,21 +699,117 @@ void subsessionByeHandler(void* clientData) {
 
 void streamTimerHandler(void* clientData) {
 	ourRTSPClient* rtspClient = (ourRTSPClient*)clientData;
+
+	// Shut down the stream:
+	shutdownStream(rtspClient, 0);
+}
+
+void keepAliveHandler(void* clientData) {
+	ourRTSPClient* rtspClient = (ourRTSPClient*)clientData;
 	StreamClientState& scs = rtspClient->scs; // alias
 
-	scs.streamTimerTask = NULL;
+	if (rtspClient->keepalive_get_parameter_) {
+		rtspClient->sendGetParameterCommand(*scs.session, continueAfterKeepAlive, NULL);
+	} else {
+		rtspClient->sendOptionsCommand(continueAfterKeepAlive);
+	}
 
-	// Shut down the stream:
-	shutdownStream(rtspClient);
+	rtspClient->loop_->timerWheel.arm(rtspClient->keepalive_timer_, rtspClient->keepalive_ms_, keepAliveHandler, rtspClient);
+}
+
+void continueAfterKeepAlive(RTSPClient* rtspClient, int resultCode, char* resultString) {
+	delete[] resultString;
+
+	// A RTSP error status (not a network error) means the server doesn't do GET_PARAMETER; fall back to OPTIONS:
+	if (resultCode > 0 && ((ourRTSPClient*)rtspClient)->keepalive_get_parameter_) {
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_STREAMING, resultCode, "GET_PARAMETER refused, keeping the session alive with OPTIONS");
+		((ourRTSPClient*)rtspClient)->keepalive_get_parameter_ = False;
+	} else if (resultCode != 0) {
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_STREAMING, resultCode, "Keep-alive failed");
+	}
+}
+
+void streamWatchdogHandler(void* clientData) {
+	ourRTSPClient* rtspClient = (ourRTSPClient*)clientData;
+	StreamLoopState* loop = rtspClient->loop_; // alias
+	SLive_RtspWatchdog& watchdog = loop->watchdog; // alias
+
+	int silentMs = (int)CRtspTimerWheel::ticks_to_ms(loop->timerWheel.now() - rtspClient->last_media_tick_);
+	if (silentMs < watchdog.stall_timeout_ms) {
+		// Check again when the latest frame is "stall_timeout_ms" old:
+		loop->timerWheel.arm(rtspClient->watchdog_timer_, watchdog.stall_timeout_ms - silentMs, streamWatchdogHandler, rtspClient);
+		return;
+	}
+
+	// (Before PLAY, "last_media_tick_" is when we connected.)  The first frame to come, from this client or a later one, ends the stall:
+	if (!loop->stalled) {
+		loop->stalled = True;
+		loop->stallTick = rtspClient->last_media_tick_;
+		if (rtspClient->frame_stats_ != NULL) rtsp_stat_add(rtspClient->frame_stats_->stalls, 1);
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_STREAMING, 0, rtspClient->media_seen_ ? "No media for %d ms"
+			: "No media %d ms after connecting", silentMs);
+		if (watchdog.stall_cb != NULL) watchdog.stall_cb(rtspClient->log_->stream_id(), true, silentMs, watchdog.stall_cb_user);
+	}
+
+	if (watchdog.reconnect) {
+		// The loop opens a new client once this one is gone:
+		shutdownStream(rtspClient, -1);
+		return;
+	}
+	loop->timerWheel.arm(rtspClient->watchdog_timer_, watchdog.stall_timeout_ms, streamWatchdogHandler, rtspClient);
+}
+
+void streamMediaArrived(RTSPClient* rtspClient) {
+	StreamLoopState* loop = ((ourRTSPClient*)rtspClient)->loop_; // alias
+	SLive_RtspWatchdog& watchdog = loop->watchdog; // alias
+
+	// Getting to PLAY is not enough (a server may accept the session and send nothing): the backoff starts over only now
+	((ourRTSPClient*)rtspClient)->media_seen_ = True;
+	loop->reconnectAttempts = 0;
+
+	if (loop->stalled) {
+		loop->stalled = False;
+		int silentMs = (int)CRtspTimerWheel::ticks_to_ms(((ourRTSPClient*)rtspClient)->last_media_tick_ - loop->stallTick);
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_STREAMING, 0, "Media is arriving again, after %d ms", silentMs);
+		if (watchdog.stall_cb != NULL) watchdog.stall_cb(((ourRTSPClient*)rtspClient)->log_->stream_id(), false, silentMs, watchdog.stall_cb_user);
+	}
+}
+
+void reconnectHandler(void* clientData) {
+	StreamLoopState* loop = (StreamLoopState*)clientData;
+
+	if (loop->client != NULL || loop->admissionTicket != NULL) return; // (sanity check)
+	if (loop->frameStats != NULL) rtsp_stat_add(loop->frameStats->reconnects, 1);
+	loop->openClient();
+}
+
+void admissionGranted(void* clientData) {
+	StreamLoopState* loop = (StreamLoopState*)clientData;
+
+	// "triggerEvent()" is the one live555 call that may be made from another thread:
+	loop->env.taskScheduler().triggerEvent(loop->admissionTrigger, loop);
+}
+
+void admissionHandler(void* clientData) {
+	((StreamLoopState*)clientData)->pollAdmission();
+}
+
+void connectHandler(void* clientData) {
+	StreamLoopState* loop = (StreamLoopState*)clientData;
+
+	loop->admissionTask = NULL;
+	loop->connectClient();
 }
 
-void shutdownStream(RTSPClient* rtspClient, int exitCode) {
+void shutdownStream(RTSPClient* rtspClient, int resultCode) {
 
 	//((ourRTSPClient*)rtspClient)->mutex_->get_mutex();
 
-	UsageEnvironment& env = rtspClient->envir(); // alias
 	StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
 
+	// If we're still in the middle of the handshake, let the next queued stream start:
+	((ourRTSPClient*)rtspClient)->finish_handshake();
+
 	// First, check whether any subsessions have still to be closed:
 	if (scs.session != NULL) { 
 		Boolean someSubsessionsWereActive = False;
@@ -425,14 +829,14 @@ void shutdownStream(RTSPClient* rtspClient, int exitCode) {
 			}
 		}
 
-		if (someSubsessionsWereActive) {
+		if (someSubsessionsWereActive && !((ourRTSPClient*)rtspClient)->replaying_) {
 			// Send a RTSP "TEARDOWN" command, to tell the server to shutdown the stream.
 			// Don't bother handling the response to the "TEARDOWN".
 			rtspClient->sendTeardownCommand(*scs.session, NULL);
 		}
 	}
 
-	env << *rtspClient << "Closing the stream.\n";
+	CLIENT_LOG(rtspClient, resultCode != 0 ? LIVE_LOG_LEVEL_WARN : LIVE_LOG_LEVEL_INFO, LIVE_PHASE_TEARDOWN, resultCode, "Closing the stream.");
 
 	Medium::close(rtspClient);
 	// Note that this will also cause this stream's "StreamClientState" structure to get reclaimed.
@@ -449,6 +853,33 @@ void shutdownStream(RTSPClient* rtspClient, int exitCode) {
 }
 
 
+// Capture mode helpers:
+
+unsigned subsessionIndex(MediaSubsession& subsession) {
+	MediaSubsessionIterator iter(subsession.parentSession());
+	unsigned index = 0;
+	for (MediaSubsession* s = iter.next(); s != NULL && s != &subsession; s = iter.next()) ++index;
+
+	return index;
+}
+
+void captureRtspResult(RTSPClient* rtspClient, char const* command, int resultCode, unsigned subsession, char const* fmt, ...) {
+	CRtspCaptureWriter& capture = ((ourRTSPClient*)rtspClient)->loop_->capture; // alias
+	if (!capture.is_open()) return;
+
+	char text[1024];
+	int len = _snprintf_s(text, sizeof(text), _TRUNCATE, "%s %d ", command, resultCode);
+	if (len < 0) len = 0;
+
+	va_list args;
+	va_start(args, fmt);
+	_vsnprintf_s(text + len, sizeof(text) - len, _TRUNCATE, fmt, args);
+	va_end(args);
+
+	capture.write(RTSP_CAPTURE_RTSP, subsession, text, (unsigned)strlen(text));
+}
+
+
 // Implementation of "ourRTSPClient":
 
 ourRTSPClient* ourRTSPClient::createNew(UsageEnvironment& env, char const* rtspURL,
@@ -458,12 +889,10 @@ ourRTSPClient* ourRTSPClient::createNew(UsageEnvironment& env, char const* rtspU
 
 void ourRTSPClient::set_rtsp_param(  rtsp_data_callback rtsp_data_cb,
 	void* rtsp_data_cb_user,
-	bool *is_need_shutdown_stream,
 	CClientMutex *mutex)
 {
 	rtsp_data_cb_ = rtsp_data_cb;
 	rtsp_data_cb_user_ = rtsp_data_cb_user;
-	is_need_shutdown_stream_ = is_need_shutdown_stream;
 	mutex_ = mutex;
 
 	return;
@@ -474,29 +903,94 @@ ourRTSPClient::ourRTSPClient(UsageEnvironment& env, char const* rtspURL,
 	: RTSPClient(env,rtspURL, verbosityLevel, applicationName, tunnelOverHTTPPortNum, -1) ,
 	rtsp_data_cb_(NULL),
 	rtsp_data_cb_user_(NULL),
-	is_need_shutdown_stream_(NULL),
 	mutex_(NULL),
-	has_audio_stream_(false)
+	has_audio_stream_(NULL),
+	loop_(NULL),
+	log_(NULL),
+	admission_ticket_(NULL),
+	startup_timing_(NULL),
+	handshake_tick_(0),
+	numa_node_(-1),
+	frame_stats_(NULL),
+	frame_queue_(NULL),
+	streaming_over_tcp_(REQUEST_STREAMING_OVER_TCP),
+	archive_progress_(NULL),
+	archive_mutex_(NULL),
+	archive_resume_(0.0),
+	keepalive_ms_(0),
+	keepalive_get_parameter_(True),
+	last_media_tick_(0),
+	media_seen_(False),
+	replaying_(False)
 {
 }
 
 ourRTSPClient::~ourRTSPClient() {
+	finish_handshake();
+
+	CRtspTimerWheel::cancel(keepalive_timer_);
+	CRtspTimerWheel::cancel(watchdog_timer_);
+	if (loop_ != NULL) loop_->clientClosed(this);
+}
+
+Boolean ourRTSPClient::setRequestFields(RequestRecord* request,
+	char*& cmdURL, Boolean& cmdURLWasAllocated,
+	char const*& protocolStr,
+	char*& extraHeaders, Boolean& extraHeadersWereAllocated) {
+	if (!RTSPClient::setRequestFields(request, cmdURL, cmdURLWasAllocated, protocolStr, extraHeaders, extraHeadersWereAllocated)) return False;
+	if (!archive_param_.enabled || strcmp(request->commandName(), "PLAY") != 0) return True;
+
+	// "Speed:" (RFC 7826, and what NVRs read for a faster download) changes the delivery rate only, unlike "Scale:".
+	// ONVIF replay servers stop pacing altogether on "Rate-Control: no":
+	std::string archiveHeaders;
+	if (archive_param_.speed != 1.0f) {
+		char speed[64]; // "%.3f" of FLT_MAX needs 43 characters
+		_snprintf_s(speed, sizeof(speed), _TRUNCATE, "Speed: %.3f\r\n", archive_param_.speed);
+		archiveHeaders += speed;
+	}
+	if (archive_param_.no_rate_control) archiveHeaders += "Rate-Control: no\r\n";
+	if (archiveHeaders.empty()) return True;
+
+	char* headers = new char[strlen(extraHeaders) + archiveHeaders.size() + 1];
+	strcpy(headers, extraHeaders);
+	strcat(headers, archiveHeaders.c_str());
+	if (extraHeadersWereAllocated) delete[] extraHeaders;
+	extraHeaders = headers;
+	extraHeadersWereAllocated = True;
+
+	return True;
+}
+
+void ourRTSPClient::finish_handshake()
+{
+	if(NULL == admission_ticket_) return;
+
+	int handshake_ms = (int)(GetTickCount() - handshake_tick_);
+	if(NULL != startup_timing_)
+	{
+		SLive_RtspStartupTiming timing;
+		CRtspAdmission::instance().load_timing(*startup_timing_, timing);
+		timing.handshake_ms = handshake_ms;
+		CRtspAdmission::instance().store_timing(*startup_timing_, timing);
+	}
+	RTSP_LOG(log_, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_PLAY, 0, "Handshake finished after %d ms", handshake_ms);
+
+	CRtspAdmission::instance().release(admission_ticket_);
+	admission_ticket_ = NULL;
 }
 
 
 // Implementation of "StreamClientState":
 
 StreamClientState::StreamClientState()
-	: iter(NULL), session(NULL), subsession(NULL), streamTimerTask(NULL), duration(0.0) {
+	: iter(NULL), session(NULL), subsession(NULL), duration(0.0) {
 }
 
 StreamClientState::~StreamClientState() {
 	delete iter;
+	CRtspTimerWheel::cancel(streamTimer);
 	if (session != NULL) {
-		// We also need to delete "session", and unschedule "streamTimerTask" (if set)
-		UsageEnvironment& env = session->envir(); // alias
-
-		env.taskScheduler().unscheduleDelayedTask(streamTimerTask);
+		// We also need to delete "session"
 		Medium::close(session);
 	}
 }
@@ -508,40 +1002,89 @@ StreamClientState::~StreamClientState() {
 // Define the size of the buffer that we'll use:
 #define DUMMY_SINK_RECEIVE_BUFFER_SIZE 1024*1024
 
-DummySink* DummySink::createNew(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId) {
-	return new DummySink(env, subsession, streamId);
+DummySink* DummySink::createNew(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId, int numaNode) {
+	return new DummySink(env, subsession, streamId, numaNode);
 }
 
 void DummySink::set_rtsp_param(  rtsp_data_callback rtsp_data_cb,
 	void* rtsp_data_cb_user,
-	bool *is_need_shutdown_stream,
 	CClientMutex *mutex)
 {
 	rtsp_data_cb_ = rtsp_data_cb;
 	rtsp_data_cb_user_ = rtsp_data_cb_user;
-	is_need_shutdown_stream_ = is_need_shutdown_stream;
 	mutex_ = mutex;
 
 	return;
 }
 
-DummySink::DummySink(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId)
+void DummySink::set_loss_policy(const SLive_RtspLossPolicy& loss_policy, ERtspKeyframeFeedback keyframe_feedback, Boolean rtcp_reduced_size,
+	Boolean streaming_over_tcp, Boolean srtp)
+{
+	loss_policy_ = loss_policy;
+	keyframe_feedback_ = keyframe_feedback;
+	rtcp_reduced_size_ = rtcp_reduced_size;
+	streaming_over_tcp_ = streaming_over_tcp;
+	srtp_ = srtp;
+
+	return;
+}
+
+DummySink::DummySink(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId, int numaNode)
 	: MediaSink(env),
+	fReceiveBuffer(NULL),
+	fSlot(-1),
+	fScratchBuffer(NULL),
+	fNumaNode(numaNode),
 	fSubsession(subsession),
 	rtsp_data_cb_(NULL),
 	rtsp_data_cb_user_(NULL),
-	is_need_shutdown_stream_(NULL),
-	mutex_(NULL)
+	mutex_(NULL),
+	frame_stats_(NULL),
+	frame_queue_(NULL),
+	keyframe_feedback_(RTSP_KEYFRAME_FEEDBACK_NONE),
+	rtcp_reduced_size_(False),
+	streaming_over_tcp_(False),
+	srtp_(False),
+	last_keyframe_request_tick_(0),
+	fir_seq_(0),
+	archive_progress_(NULL),
+	archive_mutex_(NULL),
+	archive_base_(0.0),
+	timer_wheel_(NULL),
+	media_client_(NULL),
+	capture_(NULL),
+	capture_subsession_(0),
+	read_observer_(NULL),
+	read_observer_data_(NULL)
 {
 		fStreamId = strDup(streamId);
-		fReceiveBuffer = new u_int8_t[DUMMY_SINK_RECEIVE_BUFFER_SIZE];
+
+		codec_ = rtsp_sink_codec(subsession.mediumName(), subsession.codecName());
+		rtsp_frame_info_template(codec_, subsession.numChannels(), subsession.rtpTimestampFrequency(), frame_info_);
+
+		// See every RTP packet as it is read, for the loss check (and the capture):
+		if (subsession.rtpSource() != NULL) subsession.rtpSource()->setAuxilliaryReadHandler(packetRead, this);
 }
 
 DummySink::~DummySink() {
-	delete[] fReceiveBuffer;
+	if (fSubsession.rtpSource() != NULL) fSubsession.rtpSource()->setAuxilliaryReadHandler(NULL, NULL);
+	if (fSlot >= 0) frame_queue_->recycle_slot(fSlot);
+	rtsp_free_buffer(fScratchBuffer);
 	delete[] fStreamId;
 }
 
+#ifdef RTSP_CLIENT_FRAME_TIMING
+static LONGLONG qpc_frequency() {
+	static LONGLONG frequency = 0;
+	if (frequency == 0) {
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency = f.QuadPart;
+	}
+	return frequency;
+}
+#endif
+
 void DummySink::afterGettingFrame(void* clientData, unsigned frameSize, unsigned numTruncatedBytes,
 struct timeval presentationTime, unsigned durationInMicroseconds) {
 	DummySink* sink = (DummySink*)clientData;
@@ -554,80 +1097,157 @@ struct timeval presentationTime, unsigned durationInMicroseconds) {
 void DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes,
 struct timeval presentationTime, unsigned /*durationInMicroseconds*/) {
 	// We've just received a frame of data.  (Optionally) print out information about it:
-
-	if(!strcmp(fSubsession.mediumName(), "video"))
+#ifdef RTSP_CLIENT_FRAME_TIMING
+	LARGE_INTEGER start_tick;
+	QueryPerformanceCounter(&start_tick);
+#endif
+
+	// The codec was resolved when the sink was created; per frame only the timestamp and the key frame flag change:
+	// live555 hands us whatever survived of a frame, so check the RTP sequence numbers for what didn't:
+	RTPSource* rtpSource = fSubsession.rtpSource();
+	Boolean damaged = numTruncatedBytes > 0 || (rtpSource != NULL && rtsp_seq_frame_lost(seq_tracker_, rtpSource->curPacketRTPSeqNum()));
+
+	// The frame already sits in its slot, so publishing it (to the callback, or to the pull consumer) copies nothing:
+	if(fSlot >= 0)
 	{
-		if(!strcmp(fSubsession.codecName(), "H264"))	/* h264Ƶ֧ */
-		{	
-			SLive_RtspDataInfo rtsp_data_info;
-			rtsp_data_info.data_type = LIVE_RTSP_DATA_TYPE_V;
-			rtsp_data_info.video_param.video_encode_type = LIVE_ENCODE_V_H264;
-			rtsp_data_info.video_param.pts = (presentationTime.tv_sec + presentationTime.tv_usec/(double)1000000)*90000;	//90KHz
-
-			if(fReceiveBuffer[0] == 0x65 || fReceiveBuffer[0] == 0x25 || fReceiveBuffer[0] == 0x67 || fReceiveBuffer[0] == 0x68)
-			{
-				rtsp_data_info.video_param.is_i_frame = true;
-			}
+		rtsp_stamp_frame(codec_, fReceiveBuffer, frameSize, presentationTime.tv_sec, presentationTime.tv_usec, frame_info_);
 
-			rtsp_data_cb_(fReceiveBuffer, frameSize, rtsp_data_info, rtsp_data_cb_user_);
+		frame_info_.integrity = rtsp_frame_integrity(integrity_state_, codec_, fReceiveBuffer, frameSize, damaged != False);
+		if(integrity_state_.in_recovery) requestKeyFrame(); // again every interval, until the key frame is here
 
-		}
-		else if(!strcmp(fSubsession.codecName(), "MP2T"))	/* TS鲥֧ */
+		if(NULL != frame_stats_)
 		{
-			SLive_RtspDataInfo rtsp_data_info;
-			rtsp_data_info.video_param.video_encode_type = LIVE_ENCODE_V_MP2T;
+			if(LIVE_FRAME_DAMAGED == frame_info_.integrity) rtsp_stat_add(frame_stats_->damaged_frames, 1);
+			else if(LIVE_FRAME_DEPENDS_ON_DAMAGED == frame_info_.integrity) rtsp_stat_add(frame_stats_->dependent_frames, 1);
+		}
 
-			rtsp_data_cb_(fReceiveBuffer, frameSize, rtsp_data_info, rtsp_data_cb_user_);
+		if(loss_policy_.skip_until_keyframe && RTSP_SINK_CODEC_H264 == codec_ && LIVE_FRAME_COMPLETE != frame_info_.integrity)
+		{
+			frame_queue_->recycle_slot(fSlot);
+			if(NULL != frame_stats_) rtsp_stat_add(frame_stats_->skipped_frames, 1);
 		}
 		else
 		{
-			/* do something */
+			frame_queue_->publish(fSlot, frameSize, frame_info_);
 		}
+		fSlot = -1;
 	}
-	if(!strcmp(fSubsession.mediumName(), "audio"))
+	else if(RTSP_SINK_CODEC_NONE != codec_)
 	{
-		SLive_RtspDataInfo rtsp_data_info;
-		if(!strcmp(fSubsession.codecName(), "PCMA"))				//g711a Ƶ֧
-		{
-			rtsp_data_info.data_type = LIVE_RTSP_DATA_TYPE_A;
-			rtsp_data_info.audio_param.audio_encode_type = LIVE_ENCODE_A_PCMA;
-			rtsp_data_info.audio_param.channels = fSubsession.numChannels();
-			rtsp_data_info.audio_param.samples_rate = fSubsession.rtpTimestampFrequency();
-			rtsp_data_info.audio_param.pts = (presentationTime.tv_sec + presentationTime.tv_usec/(double)1000000)*90000; //90KHz
-
-			rtsp_data_cb_(fReceiveBuffer, frameSize, rtsp_data_info, rtsp_data_cb_user_);
-
-		}
-		else if(!strcmp(fSubsession.codecName(), "MPEG4-GENERIC"))	//aac Ƶ֧
-		{
-			rtsp_data_info.data_type = LIVE_RTSP_DATA_TYPE_A;
-			rtsp_data_info.audio_param.audio_encode_type = LIVE_ENCODE_A_AAC;
-			rtsp_data_info.audio_param.channels = fSubsession.numChannels();
-			rtsp_data_info.audio_param.samples_rate = fSubsession.rtpTimestampFrequency();
-			rtsp_data_info.audio_param.pts = (presentationTime.tv_sec + presentationTime.tv_usec/(double)1000000)*90000; //90KHz
+		// Nobody will ever see this frame, so whatever is predicted from it is broken as well:
+		rtsp_frame_integrity(integrity_state_, codec_, fReceiveBuffer, frameSize, true);
+		if(integrity_state_.in_recovery) requestKeyFrame();
 
-			rtsp_data_cb_(fReceiveBuffer, frameSize, rtsp_data_info, rtsp_data_cb_user_);
+		if(NULL != frame_stats_) rtsp_stat_add(frame_stats_->queue_full_frames, 1);
+	}
 
-		}
-		else
+	// Bulk download: count the media time of every frame, delivered or not:
+	if(NULL != archive_progress_)
+	{
+		double position = archive_base_ + rtsp_archive_advance(archive_clock_, presentationTime.tv_sec, presentationTime.tv_usec,
+			rtpSource != NULL && rtpSource->hasBeenSynchronizedUsingRTCP());
+		if(archive_progress_->duration > 0 && position > archive_progress_->duration) position = archive_progress_->duration;
+		if(position > archive_progress_->position) // audio and video cover the same range
 		{
-			//
+			archive_mutex_->get_mutex();
+			archive_progress_->position = position;
+			archive_mutex_->release_mutex();
 		}
 	}
 
-	*is_need_shutdown_stream_ = true;
+	if(NULL != frame_stats_)
+	{
+		rtsp_stat_add(frame_stats_->frames, 1);
+		rtsp_stat_add(frame_stats_->bytes, frameSize);
+		if(numTruncatedBytes > 0) rtsp_stat_add(frame_stats_->truncated_frames, 1);
+#ifdef RTSP_CLIENT_FRAME_TIMING
+		LARGE_INTEGER end_tick;
+		QueryPerformanceCounter(&end_tick);
+
+		unsigned __int64 dispatch_ns = (unsigned __int64)(end_tick.QuadPart - start_tick.QuadPart) * 1000000000 / qpc_frequency();
+		rtsp_stat_add(frame_stats_->dispatch_ns, dispatch_ns);
+		if(dispatch_ns > frame_stats_->max_dispatch_ns) rtsp_stat_set(frame_stats_->max_dispatch_ns, dispatch_ns); // only this thread writes it
+#endif
+	}
 
-	// Then continue, to request the next frame of data:
-	mutex_->get_mutex();
+	// Feed the stream watchdog; this store is all it costs per frame:
+	if (media_client_ != NULL) {
+		media_client_->last_media_tick_ = timer_wheel_->now();
+		if (!media_client_->media_seen_ || media_client_->loop_->stalled) streamMediaArrived(media_client_);
+	}
+
+	// Then continue, to request the next frame of data.
+	// (We're called from within the event loop, which already holds "mutex_", so there's no need to take it again here.)
 	continuePlaying();
-	mutex_->release_mutex();
+}
+
+void DummySink::set_capture(CRtspCaptureWriter* capture, unsigned subsessionIndex)
+{
+	capture_ = capture;
+	capture_subsession_ = subsessionIndex;
+
+	return;
+}
+
+// live555 shows us every RTP packet of the subsession right after reading it (from UDP, or from the RTSP connection),
+// before its reordering buffer.  We note its sequence number, and capture mode copies it into the capture's current
+// block (its own thread writes the disk):
+void DummySink::packetRead(void* clientData, unsigned char* packet, unsigned& packetSize) {
+	DummySink* sink = (DummySink*)clientData;
+
+	rtsp_seq_received(sink->seq_tracker_, packet, packetSize);
+	if (sink->capture_ != NULL) sink->capture_->write(RTSP_CAPTURE_RTP, sink->capture_subsession_, packet, packetSize);
+	if (sink->read_observer_ != NULL) sink->read_observer_(sink->read_observer_data_, packet, packetSize);
+}
+
+void DummySink::requestKeyFrame() {
+	if (!loss_policy_.request_keyframe || RTSP_SINK_CODEC_H264 != codec_) return;
+
+	// We can only reach the server's RTCP port directly when streaming over UDP:
+	if (streaming_over_tcp_) return;
+	// Nor on a SRTP session: live555 only protects the RTCP it builds itself, the server would drop our feedback packet as
+	// unauthenticated (and it would carry our SSRCs in the clear):
+	if (srtp_) return;
+
+	ERtspKeyframeFeedback feedback = keyframe_feedback_;
+	if (feedback == RTSP_KEYFRAME_FEEDBACK_NONE && loss_policy_.force_keyframe_request) feedback = RTSP_KEYFRAME_FEEDBACK_PLI;
+	if (feedback == RTSP_KEYFRAME_FEEDBACK_NONE) return;
+
+	DWORD now = GetTickCount();
+	if (last_keyframe_request_tick_ != 0 && now - last_keyframe_request_tick_ < (DWORD)loss_policy_.keyframe_request_interval_ms) return;
+
+	RTPSource* rtpSource = fSubsession.rtpSource();
+	RTCPInstance* rtcp = fSubsession.rtcpInstance();
+	if (rtpSource == NULL || rtcp == NULL || rtcp->RTCPgs() == NULL) return;
+
+	// Servers (live555 among them) drop RTCP that isn't a compound packet, unless reduced-size RTCP was negotiated.
+	// Our CNAME is the one live555 puts into the receiver reports of this session:
+	unsigned char packet[RTSP_KEYFRAME_REQUEST_MAX];
+	unsigned packetSize = rtsp_build_keyframe_request(packet, feedback, rtpSource->SSRC(), rtpSource->lastReceivedSSRC(), fir_seq_++,
+		rtcp_reduced_size_ ? NULL : fSubsession.parentSession().CNAME());
+	rtcp->RTCPgs()->output(envir(), packet, packetSize);
+
+	last_keyframe_request_tick_ = now;
+	if (frame_stats_ != NULL) rtsp_stat_add(frame_stats_->keyframe_requests, 1);
 }
 
 Boolean DummySink::continuePlaying() {
 	if (fSource == NULL) return False; // sanity check (should not happen)
 
+	// Receive straight into a slot of the stream's frame queue.  If the consumer is holding every slot (or we don't
+	// deliver this codec at all), receive into our own scratch buffer instead; that frame is then dropped:
+	unsigned bufferSize = DUMMY_SINK_RECEIVE_BUFFER_SIZE;
+	fSlot = (RTSP_SINK_CODEC_NONE != codec_ && NULL != frame_queue_) ? frame_queue_->acquire_slot() : -1;
+	if (fSlot >= 0) {
+		fReceiveBuffer = frame_queue_->slot_data(fSlot);
+		bufferSize = frame_queue_->slot_size();
+	} else {
+		if (fScratchBuffer == NULL) fScratchBuffer = rtsp_alloc_buffer(DUMMY_SINK_RECEIVE_BUFFER_SIZE, fNumaNode);
+		fReceiveBuffer = fScratchBuffer;
+	}
+
 	// Request the next frame of data from our input source.  "afterGettingFrame()" will get called later, when it arrives:
-	fSource->getNextFrame(fReceiveBuffer, DUMMY_SINK_RECEIVE_BUFFER_SIZE,
+	fSource->getNextFrame(fReceiveBuffer, bufferSize,
 		afterGettingFrame, this,
 		onSourceClosure, this);
 	return True;
@@ -635,16 +1255,44 @@ Boolean DummySink::continuePlaying() {
 
 
 
+static volatile LONG g_next_stream_id = 0;
+
+#define RTSP_CLIENT_CPU_SAMPLE_INTERVAL	1000	//ms
+
+static unsigned __int64 current_thread_cpu_us()
+{
+	FILETIME creation, exit, kernel, user;
+	if(!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) return 0;
+
+	unsigned __int64 k = ((unsigned __int64)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	unsigned __int64 u = ((unsigned __int64)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (k + u) / 10;	/* 100ns ticks */
+}
+
 CRTSPClient::CRTSPClient():
-is_need_shutdown_stream_(false),
+stream_id_((unsigned)InterlockedIncrement(&g_next_stream_id)),
+	log_level_(CRtspLogger::instance().default_level()),
 	rtsp_live_client_(NULL),
-	event_loop_execute_(0)
+	has_audio_stream_(0),
+	event_loop_execute_(0),
+	loop_thread_(NULL),
+	priority_(LIVE_PRIORITY_LIVE),
+	frame_queue_(NULL),
+	pull_slot_count_(0),
+	pull_slot_size_(0),
+	replay_original_timing_(false),
+	replay_finished_(0)
 {
+	capture_path_[0] = '\0';
+	replay_path_[0] = '\0';
 	return;
 }
 
 CRTSPClient::~CRTSPClient()
 {
+	// The loop thread receives into the queue until it has exited; the queue cancels the waits of pending co_awaits first:
+	stop();
+	delete (CRtspFrameQueue*)frame_queue_;
 	return;
 }
 
@@ -652,8 +1300,24 @@ typedef struct RTSPClientThreadParam_S
 {
 	rtsp_data_callback rtsp_data_cb;
 	void* user_param;
-	bool* is_need_shutdown_stream;
-	void** rtsp_live_client;
+	unsigned stream_id;
+	volatile long* log_level;
+	ELive_RtspPriority priority;
+	SLive_RtspStartupTiming* startup_timing;
+	SLive_RtspPlacement placement;
+	SLive_RtspFrameStats* frame_stats;
+	CRtspFrameQueue* frame_queue;
+	SLive_RtspLossPolicy loss_policy;
+	SLive_RtspArchiveParam archive_param;
+	SLive_RtspArchiveProgress* archive_progress;
+	CClientMutex* archive_mutex;
+	SLive_RtspWatchdog watchdog;
+	char capture_path[MAX_PATH];
+	char replay_path[MAX_PATH];
+	bool replay_original_timing;
+	volatile char* replay_finished;
+	void** rtsp_live_client;
+	volatile LONG* has_audio_stream;
 	char* event_loop_execute;
 	char url[256];
 	CClientMutex* mutex;
@@ -665,17 +1329,34 @@ void CRTSPClient::run(std::string url, rtsp_data_callback rtsp_data_cb, void* us
 	std::string url_t = url;
 	if(url_t[url_t.size()-1] == '\n')
 	{
-		url = url_t.substr(0, url_t.size()-1);
+		url = url_t.substr(0, url_t.size()-1);
 	}
 
+	// One loop thread per client: everything below is shared with it
+	stop();
 
 	RTSPClientThreadParam_S *thread_param = (RTSPClientThreadParam_S*) malloc(sizeof(RTSPClientThreadParam_S));
 	if(NULL == thread_param) return;
 	memset(thread_param, 0, sizeof(RTSPClientThreadParam_S));
 	thread_param->rtsp_data_cb = rtsp_data_cb;
 	thread_param->user_param = user_param;
-	thread_param->is_need_shutdown_stream = &is_need_shutdown_stream_;
+	thread_param->stream_id = stream_id_;
+	thread_param->log_level = &log_level_;
+	thread_param->priority = priority_;
+	thread_param->startup_timing = &startup_timing_;
+	thread_param->placement = placement_;
+	thread_param->frame_stats = &frame_stats_;
+	thread_param->loss_policy = loss_policy_;
+	thread_param->archive_param = archive_param_;
+	thread_param->archive_progress = &archive_progress_;
+	thread_param->archive_mutex = &archive_mutex_;
+	thread_param->watchdog = watchdog_;
+	strncpy_s(thread_param->capture_path, sizeof(thread_param->capture_path), capture_path_, _TRUNCATE);
+	strncpy_s(thread_param->replay_path, sizeof(thread_param->replay_path), replay_path_, _TRUNCATE);
+	thread_param->replay_original_timing = replay_original_timing_;
+	thread_param->replay_finished = &replay_finished_;
 	thread_param->rtsp_live_client = &rtsp_live_client_;
+	thread_param->has_audio_stream = &has_audio_stream_;
 	thread_param->event_loop_execute = &event_loop_execute_;
 	thread_param->mutex = &mutex_;
 	if(url.size() > 256)
@@ -687,33 +1368,642 @@ void CRTSPClient::run(std::string url, rtsp_data_callback rtsp_data_cb, void* us
 		memcpy(thread_param->url, url.c_str(), url.size());
 	}
 
-	uintptr_t thread_h = _beginthreadex(NULL, 0, open_rtsp_thread, thread_param, 0, NULL);
-	CloseHandle((HANDLE)thread_h);
+	frame_stats_ = SLive_RtspFrameStats();
+	archive_mutex_.get_mutex();
+	archive_progress_ = SLive_RtspArchiveProgress();
+	archive_mutex_.release_mutex();
+	replay_finished_ = 0;
+	SLive_RtspStartupTiming startup_timing;
+	startup_timing.priority = priority_;
+	CRtspAdmission::instance().store_timing(startup_timing_, startup_timing);
+
+	// The callback is just the synchronous consumer of the same slot queue the pull API reads from.
+	// (One slot per audio/video sink is enough there, the slot is free again as soon as the callback returns.)
+	// The queue outlives the runs: the pull consumer may still hold frames of the previous one, and frame_event() stays valid.
+	if(NULL == frame_queue_)
+	{
+		if(pull_slot_count_ > 0)
+		{
+			frame_queue_ = new CRtspFrameQueue(pull_slot_count_, pull_slot_size_, NULL, NULL);
+		}
+		else
+		{
+			frame_queue_ = new CRtspFrameQueue(2, DUMMY_SINK_RECEIVE_BUFFER_SIZE, rtsp_data_cb, user_param);
+		}
+	}
+	else
+	{
+		((CRtspFrameQueue*)frame_queue_)->set_callback(rtsp_data_cb, user_param);
+	}
+	thread_param->frame_queue = (CRtspFrameQueue*)frame_queue_;
+
+	loop_thread_ = (HANDLE)_beginthreadex(NULL, 0, open_rtsp_thread, thread_param, 0, NULL);
+	if(NULL == loop_thread_)
+	{
+		free(thread_param);
+	}
 
 	return;
 }
 
 void CRTSPClient::stop()
 {
-	event_loop_execute_ = 1;
-	while(0 != event_loop_execute_)
+	if(NULL == loop_thread_)
 	{
-		Sleep(2);
+		return;
 	}
 
+	event_loop_execute_ = 1;
+	WaitForSingleObject(loop_thread_, INFINITE);
+	CloseHandle(loop_thread_);
+	loop_thread_ = NULL;
+
 	return;
 }
 
 bool CRTSPClient::has_audio_stream()
 {
-	if(NULL == rtsp_live_client_)
+	// Kept up to date by the loop thread for whichever client it currently has; "mutex_" is held by the loop for every
+	// step (select included), so it is not taken here:
+	return 0 != has_audio_stream_;
+}
+
+void CRTSPClient::set_startup_priority(ELive_RtspPriority priority)
+{
+	priority_ = priority;
+}
+
+void CRTSPClient::get_startup_timing(SLive_RtspStartupTiming& timing)
+{
+	CRtspAdmission::instance().load_timing(startup_timing_, timing);
+}
+
+void CRTSPClient::set_admission_config(const SLive_RtspAdmissionConfig& config)
+{
+	CRtspAdmission::instance().set_config(config);
+}
+
+void CRTSPClient::set_loss_policy(const SLive_RtspLossPolicy& loss_policy)
+{
+	loss_policy_ = loss_policy;
+}
+
+bool CRTSPClient::set_archive_mode(const SLive_RtspArchiveParam& param)
+{
+	if(param.enabled && !(param.speed > 0.0f)) return false;	/* 0, negative, NaN */
+
+	archive_param_ = param;
+	return true;
+}
+
+void CRTSPClient::get_archive_progress(SLive_RtspArchiveProgress& progress)
+{
+	archive_mutex_.get_mutex();
+	progress = archive_progress_;
+	archive_mutex_.release_mutex();
+}
+
+void CRTSPClient::set_watchdog(const SLive_RtspWatchdog& watchdog)
+{
+	watchdog_ = watchdog;
+}
+
+void CRTSPClient::set_capture_file(const char* path)
+{
+	strncpy_s(capture_path_, sizeof(capture_path_), (NULL != path) ? path : "", _TRUNCATE);
+}
+
+bool CRTSPClient::run_replay(const char* path, rtsp_data_callback rtsp_data_cb, void* user_param, bool original_timing)
+{
+	if(NULL == path || '\0' == path[0]) return false;	/* an empty "replay_path_" would make run() a live one */
+
+	strncpy_s(replay_path_, sizeof(replay_path_), path, _TRUNCATE);
+	replay_original_timing_ = original_timing;
+	run(RTSP_REPLAY_URL, rtsp_data_cb, user_param);
+
+	// The thread has its own copy; the next run() is a live one again:
+	replay_path_[0] = '\0';
+	return true;
+}
+
+bool CRTSPClient::replay_finished() const
+{
+	return 0 != replay_finished_;
+}
+
+void CRTSPClient::enable_pull(int slot_count, int slot_size)
+{
+	pull_slot_count_ = slot_count;
+	pull_slot_size_ = slot_size;
+}
+
+int CRTSPClient::try_pop_frames(SLive_RtspFrame* frames, int max_frames)
+{
+	if(NULL == frame_queue_)
+	{
+		return 0;
+	}
+
+	consumer_mutex_.get_mutex();
+	int count = ((CRtspFrameQueue*)frame_queue_)->try_pop(frames, max_frames);
+	consumer_mutex_.release_mutex();
+
+	return count;
+}
+
+void CRTSPClient::release_frame(const SLive_RtspFrame& frame)
+{
+	if(NULL == frame_queue_)
+	{
+		return;
+	}
+
+	consumer_mutex_.get_mutex();
+	((CRtspFrameQueue*)frame_queue_)->release(frame);
+	consumer_mutex_.release_mutex();
+}
+
+HANDLE CRTSPClient::frame_event()
+{
+	if(NULL == frame_queue_)
+	{
+		return NULL;
+	}
+
+	return ((CRtspFrameQueue*)frame_queue_)->event();
+}
+
+bool CRTSPClient::register_frame_wait(SLive_RtspFrameWait* wait, WAITORTIMERCALLBACK callback)
+{
+	if(NULL == frame_queue_)
 	{
 		return false;
 	}
 
-	return ((ourRTSPClient*)rtsp_live_client_)->has_audio_stream_;
+	return ((CRtspFrameQueue*)frame_queue_)->add_wait(wait, callback);
+}
+
+bool CRTSPClient::begin_frame_wait(SLive_RtspFrameWait* wait)
+{
+	return ((CRtspFrameQueue*)frame_queue_)->begin_wait_callback(wait);
+}
+
+void CRTSPClient::end_frame_wait()
+{
+	((CRtspFrameQueue*)frame_queue_)->end_wait_callback();
+}
+
+void CRTSPClient::get_frame_stats(SLive_RtspFrameStats& stats)
+{
+	// The loop thread keeps counting while this runs, so every counter is read atomically:
+	stats.frames = rtsp_stat_load(frame_stats_.frames);
+	stats.bytes = rtsp_stat_load(frame_stats_.bytes);
+	stats.truncated_frames = rtsp_stat_load(frame_stats_.truncated_frames);
+	stats.queue_full_frames = rtsp_stat_load(frame_stats_.queue_full_frames);
+	stats.damaged_frames = rtsp_stat_load(frame_stats_.damaged_frames);
+	stats.dependent_frames = rtsp_stat_load(frame_stats_.dependent_frames);
+	stats.skipped_frames = rtsp_stat_load(frame_stats_.skipped_frames);
+	stats.keyframe_requests = rtsp_stat_load(frame_stats_.keyframe_requests);
+	stats.dispatch_ns = rtsp_stat_load(frame_stats_.dispatch_ns);
+	stats.max_dispatch_ns = rtsp_stat_load(frame_stats_.max_dispatch_ns);
+	stats.stalls = rtsp_stat_load(frame_stats_.stalls);
+	stats.reconnects = rtsp_stat_load(frame_stats_.reconnects);
+	stats.secure = *(volatile bool*)&frame_stats_.secure;
+	stats.loop_cpu_us = rtsp_stat_load(frame_stats_.loop_cpu_us);
+}
+
+void CRTSPClient::set_placement(const SLive_RtspPlacement& placement)
+{
+	placement_ = placement;
+}
+
+void CRTSPClient::colocate_with_current_thread()
+{
+	placement_ = rtsp_placement_of_current_thread();
+}
+
+void CRTSPClient::set_log_level(ELive_RtspLogLevel level)
+{
+	InterlockedExchange(&log_level_, level);
+}
+
+void CRTSPClient::set_log_callback(rtsp_log_callback log_cb, void* user_param)
+{
+	CRtspLogger::instance().set_callback(log_cb, user_param);
+}
+
+void CRTSPClient::set_default_log_level(ELive_RtspLogLevel level)
+{
+	CRtspLogger::instance().set_default_level(level);
+}
+
+// Implementation of "StreamLoopState":
+
+StreamLoopState::StreamLoopState(UsageEnvironment& env, RTSPClientThreadParam_S* threadParam, CRtspLogStream* log, int numaNode)
+	: env(env), threadParam(threadParam), log(log), numaNode(numaNode),
+	watchdog(threadParam->watchdog), frameStats(threadParam->frame_stats),
+	timerWheel(env.taskScheduler()), client(NULL), reconnectAttempts(0), stalled(False), stallTick(0), stopping(False),
+	admissionTicket(NULL), admitted(False), admissionQueueTick(0), admissionTask(NULL), replay(NULL) {
+	admissionTrigger = env.taskScheduler().createEventTrigger(admissionHandler);
+}
+
+StreamLoopState::~StreamLoopState() {
+	CRtspTimerWheel::cancel(reconnectTimer);
+
+	// Stopped while still queued (or waiting out the jitter): once released, the ticket cannot trigger us any more:
+	CRtspAdmission::instance().release(admissionTicket);
+	env.taskScheduler().unscheduleDelayedTask(admissionTask);
+	env.taskScheduler().deleteEventTrigger(admissionTrigger);
+
+	delete replay;
+	if (capture.dropped_records() > 0) {
+		RTSP_LOG(log, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_TEARDOWN, -1, "The disk fell behind the capture, %I64u records were dropped",
+			capture.dropped_records());
+	}
+	capture.close();
+}
+
+void StreamLoopState::openClient() {
+	// Wait for our turn before connecting, so that starting (or reconnecting) every camera at once does not hit the servers at once.
+	// The loop keeps running meanwhile; the grant wakes it through "admissionTrigger":
+	admissionQueueTick = GetTickCount();
+	admissionTicket = CRtspAdmission::instance().enqueue(threadParam->url, threadParam->priority, threadParam->stream_id,
+		admissionGranted, this);
+	pollAdmission();
+}
+
+void StreamLoopState::pollAdmission() {
+	if (admissionTicket == NULL || admitted) return; // (a late wakeup)
+	TaskScheduler& scheduler = env.taskScheduler(); // alias
+
+	scheduler.unscheduleDelayedTask(admissionTask); // (the retry, when woken up by the grant)
+	DWORD retryMs;
+	if (!CRtspAdmission::instance().poll(admissionTicket, retryMs)) {
+		admissionTask = scheduler.scheduleDelayedTask(retryMs * 1000, admissionHandler, this);
+		return;
+	}
+
+	SLive_RtspStartupTiming timing;
+	CRtspAdmission::instance().load_timing(*threadParam->startup_timing, timing);
+	timing.queue_ms = (int)(GetTickCount() - admissionQueueTick);
+	CRtspAdmission::instance().store_timing(*threadParam->startup_timing, timing);
+	RTSP_LOG(log, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_CONNECT, 0, "Admitted after %d ms in the startup queue", timing.queue_ms);
+
+	// Granted streams don't all connect in the same instant:
+	admitted = True;
+	if (admissionTicket->jitter_ms > 0) {
+		admissionTask = scheduler.scheduleDelayedTask(admissionTicket->jitter_ms * 1000, connectHandler, this);
+		return;
+	}
+	connectClient();
+}
+
+void StreamLoopState::connectClient() {
+	SRtspAdmissionTicket* ticket = admissionTicket;
+	admissionTicket = NULL;
+	admitted = False;
+
+	ourRTSPClient* rtspClient = createClient();
+	if (rtspClient == NULL) {
+		CRtspAdmission::instance().release(ticket);
+		if (watchdog.reconnect) scheduleReconnect();
+		return;
+	}
+	rtspClient->admission_ticket_ = ticket;
+	rtspClient->handshake_tick_ = GetTickCount();
+
+	// The watchdog runs from here on, so that a server that stops answering in the middle of the handshake is noticed
+	// (and, with "reconnect", left); PLAY restarts it for the media:
+	if (watchdog.stall_timeout_ms > 0) {
+		rtspClient->last_media_tick_ = timerWheel.now();
+		timerWheel.arm(rtspClient->watchdog_timer_, watchdog.stall_timeout_ms, streamWatchdogHandler, rtspClient);
+	}
+
+	// Next, send a RTSP "DESCRIBE" command, to get a SDP description for the stream.
+	// Note that this command - like all RTSP commands - is sent asynchronously; we do not block, waiting for a response.
+	// Instead, the following function call returns immediately, and we handle the RTSP response later, from within the event loop:
+	rtspClient->sendDescribeCommand(continueAfterDESCRIBE);
+}
+
+Boolean StreamLoopState::openReplay() {
+	replay = new StreamReplayState(*this, threadParam->replay_original_timing ? True : False);
+	if (!replay->reader.open(threadParam->replay_path)) {
+		RTSP_LOG(log, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_CONNECT, -1, "Failed to open the capture file \"%s\"", threadParam->replay_path);
+		*(threadParam->replay_finished) = 1;
+		return False;
+	}
+
+	// The session's SDP is the first one in the file:
+	std::string sdp;
+	SRtspCaptureRecord record;
+	const unsigned char* payload;
+	while (replay->reader.next(record, payload)) {
+		if (record.type == RTSP_CAPTURE_SDP) {
+			sdp.assign((const char*)payload, record.length);
+			break;
+		}
+	}
+	if (sdp.empty()) {
+		RTSP_LOG(log, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_DESCRIBE, -1, "The capture file \"%s\" has no SDP", threadParam->replay_path);
+		*(threadParam->replay_finished) = 1;
+		return False;
+	}
+
+	ourRTSPClient* rtspClient = createClient();
+	if (rtspClient == NULL) {
+		*(threadParam->replay_finished) = 1;
+		return False;
+	}
+	rtspClient->replaying_ = True;
+
+	return replay->start(rtspClient, sdp.c_str());
+}
+
+ourRTSPClient* StreamLoopState::createClient() {
+	// live555 writes its protocol dump synchronously through "env", so only turn it on when the stream is being debugged:
+	int verbosity_level = log->enabled(LIVE_LOG_LEVEL_DEBUG) ? 1 : RTSP_CLIENT_VERBOSITY_LEVEL;
+
+	ourRTSPClient* rtspClient = ourRTSPClient::createNew(env, threadParam->url, verbosity_level, "rtsp_client");
+	if (rtspClient == NULL) {
+		RTSP_LOG(log, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_CONNECT, -1, "Failed to create a RTSP client: %s", env.getResultMsg());
+		return NULL;
+	}
+
+	rtspClient->loop_ = this;
+	rtspClient->log_ = log;
+	rtspClient->startup_timing_ = threadParam->startup_timing;
+	rtspClient->numa_node_ = numaNode;
+	rtspClient->frame_stats_ = threadParam->frame_stats;
+	rtspClient->frame_queue_ = threadParam->frame_queue;
+	rtspClient->has_audio_stream_ = threadParam->has_audio_stream;
+	rtspClient->loss_policy_ = threadParam->loss_policy;
+	if (threadParam->archive_param.enabled) {
+		// A download must not lose data, and the server can only send faster than real time over a reliable transport:
+		rtspClient->archive_param_ = threadParam->archive_param;
+		rtspClient->archive_progress_ = threadParam->archive_progress;
+		rtspClient->archive_mutex_ = threadParam->archive_mutex;
+		rtspClient->archive_resume_ = threadParam->archive_progress->position; // only we write it, no need for the lock
+		rtspClient->streaming_over_tcp_ = True;
+	}
+	rtspClient->set_rtsp_param(threadParam->rtsp_data_cb, threadParam->user_param, threadParam->mutex);
+
+	client = rtspClient;
+	*(threadParam->rtsp_live_client) = (void*)rtspClient;
+	return rtspClient;
+}
+
+void StreamLoopState::clientClosed(ourRTSPClient* rtspClient) {
+	if (rtspClient != client) return;
+
+	client = NULL;
+	*(threadParam->rtsp_live_client) = NULL;
+	InterlockedExchange(threadParam->has_audio_stream, 0); // the next client finds out for itself
+
+	if (stopping || !watchdog.reconnect || replay != NULL) return;
+	if (threadParam->archive_param.enabled && threadParam->archive_progress->finished) return; // the download is complete
+	scheduleReconnect();
+}
+
+void StreamLoopState::scheduleReconnect() {
+	int delayMs = watchdog.reconnect_min_ms;
+	for (int i = 0; i < reconnectAttempts && delayMs < watchdog.reconnect_max_ms; ++i) delayMs *= 2;
+	if (delayMs > watchdog.reconnect_max_ms) delayMs = watchdog.reconnect_max_ms;
+	++reconnectAttempts;
+
+	RTSP_LOG(log, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_CONNECT, 0, "Reconnecting in %d ms (attempt %d)", delayMs, reconnectAttempts);
+	timerWheel.arm(reconnectTimer, delayMs, reconnectHandler, this);
+}
+
+
+// Implementation of "StreamReplayState":
+
+// A connected pair of loopback TCP sockets:
+static Boolean makeLoopbackConnection(SOCKET& ours, SOCKET& theirs) {
+	ours = theirs = INVALID_SOCKET;
+
+	SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener == INVALID_SOCKET) return False;
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int addrLen = sizeof(addr);
+	if (bind(listener, (const sockaddr*)&addr, sizeof(addr)) == 0 && getsockname(listener, (sockaddr*)&addr, &addrLen) == 0
+		&& listen(listener, 1) == 0) {
+		theirs = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (theirs != INVALID_SOCKET && connect(theirs, (const sockaddr*)&addr, sizeof(addr)) == 0) ours = accept(listener, NULL, NULL);
+	}
+	closesocket(listener);
+
+	if (ours == INVALID_SOCKET) {
+		if (theirs != INVALID_SOCKET) closesocket(theirs);
+		theirs = INVALID_SOCKET;
+		return False;
+	}
+	return True;
+}
+
+StreamReplayState::StreamReplayState(StreamLoopState& loop, Boolean originalTiming)
+	: fLoop(loop), fOriginalTiming(originalTiming), fClient(NULL), fSocket(INVALID_SOCKET), fClientSocket(INVALID_SOCKET),
+	fPumpTask(NULL), fBlocked(False), fPayload(NULL), fHavePacket(False), fSendOffset(0),
+	fHaveFirstArrival(False), fFirstArrivalUs(0), fStartUs(0), fSent(0), fReceived(0), fProgressTick(0) {
+	memset(fReplayed, 0, sizeof(fReplayed));
+}
+
+StreamReplayState::~StreamReplayState() {
+	fLoop.env.taskScheduler().unscheduleDelayedTask(fPumpTask);
+	if (fSocket != INVALID_SOCKET) {
+		fLoop.env.taskScheduler().disableBackgroundHandling((int)fSocket);
+		closesocket(fSocket);
+	}
+	if (fClientSocket != INVALID_SOCKET) closesocket(fClientSocket); // (the RTP sources are gone by now)
+	reader.close();
+}
+
+Boolean StreamReplayState::start(ourRTSPClient* rtspClient, char const* sdpDescription) {
+	UsageEnvironment& env = fLoop.env; // alias
+	StreamClientState& scs = rtspClient->scs; // alias
+	fClient = rtspClient;
+
+	scs.session = MediaSession::createNew(env, sdpDescription);
+	if (scs.session == NULL || !scs.session->hasSubsessions()) {
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_DESCRIBE, -1, "Failed to create a MediaSession object from the captured SDP: %s",
+			scs.session == NULL ? env.getResultMsg() : "no media subsessions");
+		finish();
+		return False;
+	}
+
+	if (!makeLoopbackConnection(fSocket, fClientSocket)) {
+		CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_SETUP, -1, "Failed to create the replay connection");
+		finish();
+		return False;
+	}
+	makeSocketNonBlocking((int)fSocket);
+	makeSocketNonBlocking((int)fClientSocket);
+	int noDelay = 1; // with the captured timing, a packet must not wait for the next one
+	setsockopt(fSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	// Initiate every subsession locally, as "SETUP" would have, move its RTP (and RTCP, which must not go to the captured
+	// server) onto the connection, and start its sink:
+	MediaSubsessionIterator iter(*scs.session);
+	unsigned index = 0;
+	for (MediaSubsession* subsession = iter.next(); subsession != NULL; subsession = iter.next(), ++index) {
+		if (index >= RTSP_REPLAY_MAX_SUBSESSIONS) break;
+
+		if (!subsession->initiate() || subsession->rtpSource() == NULL) {
+			CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_SETUP, -1, "Not replaying the \"%s/%s\" subsession: %s",
+				subsession->mediumName(), subsession->codecName(), env.getResultMsg());
+			continue;
+		}
+		if (strcmp(subsession->mediumName(), "audio") == 0) InterlockedExchange(rtspClient->has_audio_stream_, 1);
+
+		subsession->rtpSource()->setStreamSocket((int)fClientSocket, (unsigned char)(index * 2), NULL);
+		if (subsession->rtcpInstance() != NULL) subsession->rtcpInstance()->setStreamSocket((int)fClientSocket, (unsigned char)(index * 2 + 1), NULL);
+		if (!startSubsessionSink(rtspClient, subsession)) continue;
+
+		((DummySink*)subsession->sink)->set_read_observer(countRTPPacket, this);
+		fReplayed[index] = True;
+	}
+
+	// Whatever comes back (receiver reports) is read and dropped, so that it never fills the connection:
+	env.taskScheduler().setBackgroundHandling((int)fSocket, SOCKET_READABLE, socketHandler, this);
+
+	CLIENT_LOG(rtspClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_PLAY, 0, "Replaying \"%s\" %s", fLoop.threadParam->replay_path,
+		fOriginalTiming ? "with the captured timing" : "as fast as possible");
+
+	fStartUs = rtsp_capture_clock_us();
+	fProgressTick = GetTickCount();
+	fPumpTask = env.taskScheduler().scheduleDelayedTask(0, pumpHandler, this);
+	return True;
 }
 
+void StreamReplayState::pumpHandler(void* clientData) {
+	((StreamReplayState*)clientData)->pump();
+}
+
+void StreamReplayState::pump() {
+	fPumpTask = NULL;
+	if (fLoop.client != fClient || fBlocked) return; // (sanity check)
+
+	TaskScheduler& scheduler = fLoop.env.taskScheduler(); // alias
+
+	for (unsigned batch = 0; batch < RTSP_REPLAY_BATCH; ++batch) {
+		if (!fHavePacket && !nextPacket()) {
+			// Done sending; wait for the loop to read the rest back:
+			if (fReceived < fSent && GetTickCount() - fProgressTick < RTSP_REPLAY_STALL_MS) {
+				fPumpTask = scheduler.scheduleDelayedTask(RTSP_REPLAY_STALL_MS * 1000 / 100, pumpHandler, this);
+				return;
+			}
+			finish();
+			return;
+		}
+
+		if (fOriginalTiming && fSendOffset == 0) {
+			__int64 waitUs = (__int64)(fRecord.arrival_us - fFirstArrivalUs) - (__int64)(rtsp_capture_clock_us() - fStartUs);
+			if (waitUs > 0) {
+				fPumpTask = scheduler.scheduleDelayedTask(waitUs, pumpHandler, this);
+				return;
+			}
+		}
+
+		int result = sendPacket();
+		if (result < 0) {
+			CLIENT_LOG(fClient, LIVE_LOG_LEVEL_ERROR, LIVE_PHASE_PLAY, WSAGetLastError(), "Failed to write to the replay connection");
+			finish();
+			return;
+		}
+		if (result == 0) {
+			// The loop has not read the earlier packets yet; go on once it has made room:
+			fBlocked = True;
+			scheduler.setBackgroundHandling((int)fSocket, SOCKET_READABLE | SOCKET_WRITABLE, socketHandler, this);
+			return;
+		}
+
+		++fSent;
+		fHavePacket = False;
+	}
+
+	fPumpTask = scheduler.scheduleDelayedTask(0, pumpHandler, this);
+}
+
+Boolean StreamReplayState::nextPacket() {
+	while (reader.next(fRecord, fPayload)) {
+		// A second SDP starts the next session of a capture that reconnected; we only replay the first one:
+		if (fRecord.type == RTSP_CAPTURE_SDP) return False;
+		if (fRecord.type != RTSP_CAPTURE_RTP || fRecord.subsession >= RTSP_REPLAY_MAX_SUBSESSIONS || !fReplayed[fRecord.subsession]) continue;
+		if (fRecord.length > 0xFFFF) continue; // (cannot be interleaved; no UDP packet is that large anyway)
+
+		if (!fHaveFirstArrival) {
+			fHaveFirstArrival = True;
+			fFirstArrivalUs = fRecord.arrival_us;
+		}
+		fHavePacket = True;
+		fSendOffset = 0;
+		return True;
+	}
+
+	return False;
+}
+
+// Writes (the rest of) the current packet, behind a "$", its channel and its length (RFC 2326, 10.12).
+// 1 once all of it is sent, 0 when the connection is full, -1 on an error:
+int StreamReplayState::sendPacket() {
+	unsigned char header[4];
+	header[0] = '$';
+	header[1] = (unsigned char)(fRecord.subsession * 2);
+	header[2] = (unsigned char)(fRecord.length >> 8);
+	header[3] = (unsigned char)fRecord.length;
+
+	while (fSendOffset < 4 + fRecord.length) {
+		char const* data = fSendOffset < 4 ? (char const*)header + fSendOffset : (char const*)fPayload + (fSendOffset - 4);
+		int size = fSendOffset < 4 ? (int)(4 - fSendOffset) : (int)(4 + fRecord.length - fSendOffset);
+
+		int sent = send(fSocket, data, size, 0);
+		if (sent == SOCKET_ERROR) return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+		fSendOffset += (unsigned)sent;
+	}
+
+	return 1;
+}
+
+void StreamReplayState::socketHandler(void* clientData, int mask) {
+	StreamReplayState* replay = (StreamReplayState*)clientData;
+
+	if (mask & SOCKET_READABLE) {
+		char discard[2048];
+		while (recv(replay->fSocket, discard, sizeof(discard), 0) > 0) {}
+	}
+
+	if ((mask & SOCKET_WRITABLE) && replay->fBlocked) {
+		replay->fBlocked = False;
+		replay->fLoop.env.taskScheduler().setBackgroundHandling((int)replay->fSocket, SOCKET_READABLE, socketHandler, replay);
+		replay->pump();
+	}
+}
+
+void StreamReplayState::finish() {
+	if (fClient != NULL) {
+		if (fReceived < fSent) {
+			CLIENT_LOG(fClient, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_TEARDOWN, -1, "Replay finished: %u packets sent, but only %u read back; %u were lost",
+				fSent, fReceived, fSent - fReceived);
+		} else {
+			CLIENT_LOG(fClient, LIVE_LOG_LEVEL_INFO, LIVE_PHASE_TEARDOWN, 0, "Replay finished: %u packets sent and read back", fSent);
+		}
+	}
+	*(fLoop.threadParam->replay_finished) = 1;
+
+	if (fClient != NULL && fLoop.client == fClient) shutdownStream(fClient, 0);
+	fClient = NULL;
+}
+
+void StreamReplayState::countRTPPacket(void* clientData, unsigned char* /*packet*/, unsigned& /*packetSize*/) {
+	StreamReplayState* replay = (StreamReplayState*)clientData;
+	++replay->fReceived;
+	replay->fProgressTick = GetTickCount();
+}
+
+
 unsigned CRTSPClient::open_rtsp_thread(void* param)
 {
 	if(NULL == param)
@@ -723,25 +2013,44 @@ unsigned CRTSPClient::open_rtsp_thread(void* param)
 
 	RTSPClientThreadParam_S* thread_param = (RTSPClientThreadParam_S*) param;
 
+	// Pin ourselves first, so that everything the loop allocates below is first touched on the right node:
+	DWORD placement_error = 0;
+	int numa_node = rtsp_apply_placement(thread_param->placement, placement_error);
+
 	TaskScheduler* scheduler = BasicTaskScheduler::createNew();
 	UsageEnvironment* env = BasicUsageEnvironment::createNew(*scheduler);
 
-	// There are argc-1 URLs: argv[1] through argv[argc-1].  Open and start streaming each one:
-	RTSPClient* rtspClient = ourRTSPClient::createNew(*env, thread_param->url, RTSP_CLIENT_VERBOSITY_LEVEL, "rtsp_client");
-	if (rtspClient == NULL)
+	CRtspLogStream* log = CRtspLogger::instance().open_stream(thread_param->stream_id, thread_param->url, thread_param->log_level);
+	if(0 != placement_error)
 	{
-		return 1;
+		RTSP_LOG(log, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_CONNECT, (int)placement_error, "Failed to pin the loop thread to group %u mask 0x%I64x, it runs unpinned; buffers on node %d",
+			thread_param->placement.cpu_group, thread_param->placement.cpu_mask, numa_node);
 	}
+	else if(0 != thread_param->placement.cpu_mask)
+	{
+		RTSP_LOG(log, LIVE_LOG_LEVEL_DEBUG, LIVE_PHASE_CONNECT, 0, "Loop thread pinned to group %u mask 0x%I64x, buffers on node %d",
+			thread_param->placement.cpu_group, thread_param->placement.cpu_mask, numa_node);
+	}
+	thread_param->frame_queue->attach(numa_node);
 
-	*(thread_param->rtsp_live_client) = (void*)rtspClient;
-	((ourRTSPClient*)rtspClient)->set_rtsp_param(thread_param->rtsp_data_cb, thread_param->user_param, thread_param->is_need_shutdown_stream, thread_param->mutex);
-
-	// Next, send a RTSP "DESCRIBE" command, to get a SDP description for the stream.
-	// Note that this command - like all RTSP commands - is sent asynchronously; we do not block, waiting for a response.
-	// Instead, the following function call returns immediately, and we handle the RTSP response later, from within the event loop:
-	rtspClient->sendDescribeCommand(continueAfterDESCRIBE); 
+	// The loop state owns the stream's timers and (re)opens its "RTSPClient".  Admission does not block: the client
+	// is created from within the event loop once the stream's turn has come:
+	StreamLoopState* loop = new StreamLoopState(*env, thread_param, log, numa_node);
+	if('\0' != thread_param->replay_path[0])
+	{
+		loop->openReplay();
+	}
+	else
+	{
+		if('\0' != thread_param->capture_path[0] && !loop->capture.open(thread_param->capture_path))
+		{
+			RTSP_LOG(log, LIVE_LOG_LEVEL_WARN, LIVE_PHASE_CONNECT, -1, "Failed to open the capture file \"%s\", not capturing", thread_param->capture_path);
+		}
+		loop->openClient();
+	}
 
 	// All subsequent activity takes place within the event loop:
+	DWORD cpu_tick = GetTickCount();
 	while(true)
 	{
 		if(*(thread_param->event_loop_execute) == 1) break;
@@ -749,16 +2058,35 @@ unsigned CRTSPClient::open_rtsp_thread(void* param)
 		thread_param->mutex->get_mutex();
 		env->taskScheduler().doEventLoop(thread_param->event_loop_execute);
 		thread_param->mutex->release_mutex();
+
+		// A quiet stream still gets its last captured packets onto the disk:
+		loop->capture.flush_if_due();
+
+		// Everything this stream costs (TLS, SRTP, depacketizing) is spent on this thread; sample it now and then:
+		DWORD now = GetTickCount();
+		if(now - cpu_tick >= RTSP_CLIENT_CPU_SAMPLE_INTERVAL)
+		{
+			cpu_tick = now;
+			rtsp_stat_set(thread_param->frame_stats->loop_cpu_us, current_thread_cpu_us());
+		}
 	}
+	rtsp_stat_set(thread_param->frame_stats->loop_cpu_us, current_thread_cpu_us());
 	// This function call does not return, unless, at some point in time, "eventLoopWatchVariable" gets set to something non-zero.
 
-	if (true == *(thread_param->is_need_shutdown_stream))
+	// Only a client that is still open gets shut down; one that already went away (and took its sinks along) is not touched again:
+	thread_param->mutex->get_mutex();
+	loop->stopping = True;
+	if(NULL != loop->client)
 	{
-		shutdownStream(rtspClient);
+		shutdownStream(loop->client, 0);
 	}
+	delete loop;
+	thread_param->mutex->release_mutex();
 
+	CRtspLogger::instance().close_stream(log);
+	env->reclaim();
+	delete scheduler;
 
-	*(thread_param->is_need_shutdown_stream) = false;
 	*(thread_param->rtsp_live_client) = NULL;
 	*(thread_param->event_loop_execute) = 0;
 
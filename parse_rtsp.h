@@ -5,6 +5,21 @@
 #include <Windows.h>
 #include "common_rtsp.h"
 
+#if defined(__cpp_impl_coroutine) || (defined(_MSVC_LANG) && _MSVC_LANG > 201703L)
+#include <coroutine>
+#define RTSP_CLIENT_HAS_COROUTINES
+class CRtspNextFrame;
+#endif
+
+/* a RegisterWaitForSingleObject wait on CRTSPClient::frame_event(), see register_frame_wait() */
+typedef struct SLive_RtspFrameWait
+{
+	HANDLE handle;
+	bool cancelled;					//taken over by the client's destructor, the callback must return right away
+	void (*on_cancel)(struct SLive_RtspFrameWait* wait);	//called by the destructor instead of the callback, once it can no longer fire
+	void* context;
+}SLive_RtspFrameWait;
+
 class RTSP_PARSE_API CClientMutex
 {
 public:
@@ -25,16 +40,107 @@ public:
 	CRTSPClient();
 	~CRTSPClient();
 
+	/* a stream that is still running is stopped first */
 	void run(std::string url, rtsp_data_callback rtsp_data_cb, void* user_param);
+	/* returns once the event loop thread has exited */
 	void stop();
 
 	bool has_audio_stream();
 
+	/* startup admission: the priority must be set before run(), the timing is filled in while the stream starts */
+	void set_startup_priority(ELive_RtspPriority priority);
+	void get_startup_timing(SLive_RtspStartupTiming& timing);
+	static void set_admission_config(const SLive_RtspAdmissionConfig& config);
+
+	/* where the event loop thread runs and its receive buffers live, must be set before run().
+	 * colocate_with_current_thread() places the loop on the NUMA node of the calling (consumer) thread */
+	void set_placement(const SLive_RtspPlacement& placement);
+	void colocate_with_current_thread();
+
+	/* per frame counters of the sink path (a snapshot, written by the event loop thread) */
+	void get_frame_stats(SLive_RtspFrameStats& stats);
+
+	/* what to do with frames hit by RTP packet loss, must be set before run().
+	 * Every frame carries its SLive_RtspDataInfo::integrity either way */
+	void set_loss_policy(const SLive_RtspLossPolicy& loss_policy);
+
+	/* bulk download of a recording (NVR), must be set before run(): PLAY goes out with Speed (and "Rate-Control: no"), Scale 1,
+	 * media comes over TCP into a large socket buffer and is delivered as fast as the server sends it.
+	 * false (and the previous setting kept) for a speed that isn't > 0.  A reconnect (SLive_RtspWatchdog::reconnect) resumes
+	 * the download where the progress got to */
+	bool set_archive_mode(const SLive_RtspArchiveParam& param);
+	void get_archive_progress(SLive_RtspArchiveProgress& progress);
+
+	/* no-media watchdog, keep-alive and reconnect backoff, must be set before run() */
+	void set_watchdog(const SLive_RtspWatchdog& watchdog);
+
+	/* capture mode, must be set before run(): the SDP, the results of the RTSP commands and every RTP packet with its
+	 * arrival time go to "path" (see rtsp_capture.h); NULL or "" turns it off again */
+	void set_capture_file(const char* path);
+	/* plays a capture file back through the same depacketizing and delivery path, without a camera: as fast as the loop
+	 * takes it, or with the captured packet timing.  stop() as usual; replay_finished() once every packet was delivered.
+	 * false, without starting anything, when "path" is NULL or "" */
+	bool run_replay(const char* path, rtsp_data_callback rtsp_data_cb, void* user_param, bool original_timing = false);
+	bool replay_finished() const;
+
+	/* pull mode, must be enabled before the first run() (which then takes a NULL callback): frames are received straight into
+	 * "slot_count" buffers of "slot_size" bytes and queued for the consumer instead of being called back on the loop thread.
+	 * The slots are created by the first run() and kept until the client is destroyed, so frames may be released after stop() */
+	void enable_pull(int slot_count = 16, int slot_size = 1024*1024);
+	/* consumer side, never blocks: returns up to "max_frames" frames, each one must be handed back with release_frame().
+	 * Serialized internally, so several threads (thread pool waits, coroutines) may pop and release */
+	int try_pop_frames(SLive_RtspFrame* frames, int max_frames);
+	void release_frame(const SLive_RtspFrame& frame);
+	/* manual-reset event, signalled while frames are waiting; for WaitForMultipleObjects / RegisterWaitForSingleObject / IOCP loops.
+	 * NULL before the first run() */
+	HANDLE frame_event();
+	/* thread pool waits on frame_event() that must not outlive the client (rtsp_frame_awaitable.h uses these):
+	 * register_frame_wait() registers "callback" (WT_EXECUTEONLYONCE) with the wait as its context, false before the first run()
+	 * or once the client is being destroyed.  The callback starts with begin_frame_wait() and returns right away when that is
+	 * false; otherwise it calls end_frame_wait() once it is done with the client.  The destructor unregisters every wait that
+	 * has not fired and calls its "on_cancel" */
+	bool register_frame_wait(SLive_RtspFrameWait* wait, WAITORTIMERCALLBACK callback);
+	bool begin_frame_wait(SLive_RtspFrameWait* wait);
+	void end_frame_wait();
+#ifdef RTSP_CLIENT_HAS_COROUTINES
+	/* co_await client.next_frame(): resumes on "post(handle, executor)" when given, else on the thread pool wait thread */
+	CRtspNextFrame next_frame(void (*post)(std::coroutine_handle<> handle, void* executor) = NULL, void* executor = NULL);
+#endif
+
+	/* log level of this stream, may be changed at any time (including while it is running) */
+	void set_log_level(ELive_RtspLogLevel level);
+	unsigned stream_id() const {return stream_id_;}
+
+	/* process wide: where log records go (stderr when NULL) and the level new clients start with */
+	static void set_log_callback(rtsp_log_callback log_cb, void* user_param);
+	static void set_default_log_level(ELive_RtspLogLevel level);
+
 private:
 	static unsigned __stdcall open_rtsp_thread(void* param);
 
-	bool is_need_shutdown_stream_;
+	unsigned stream_id_;
+	volatile long log_level_;
 	void* rtsp_live_client_;
+	volatile LONG has_audio_stream_;
 	char event_loop_execute_;
+	HANDLE loop_thread_;
 	CClientMutex mutex_;
+	CClientMutex consumer_mutex_;	//the frame queue has a single consumer side, pull callers may be many
+
+	ELive_RtspPriority priority_;
+	SLive_RtspStartupTiming startup_timing_;
+	SLive_RtspPlacement placement_;
+	SLive_RtspFrameStats frame_stats_;
+	void* frame_queue_;
+	int pull_slot_count_;
+	int pull_slot_size_;
+	SLive_RtspLossPolicy loss_policy_;
+	SLive_RtspArchiveParam archive_param_;
+	SLive_RtspArchiveProgress archive_progress_;
+	CClientMutex archive_mutex_;	//the loop thread writes the progress under it, get_archive_progress() reads under it
+	SLive_RtspWatchdog watchdog_;
+	char capture_path_[MAX_PATH];
+	char replay_path_[MAX_PATH];
+	bool replay_original_timing_;
+	volatile char replay_finished_;
 };
\ No newline at end of file
@@ -0,0 +1,200 @@
+#include "rtsp_admission.h"
+
+#define RTSP_ADMISSION_IDLE_WAIT	1000	//ms, how often a queued stream re-checks on its own (slot timeouts)
+
+std::string rtsp_url_host(const char* url)
+{
+	std::string host = url;
+
+	size_t pos = host.find("://");
+	if(pos != std::string::npos) host = host.substr(pos + 3);
+
+	pos = host.find('/');
+	if(pos != std::string::npos) host = host.substr(0, pos);
+
+	pos = host.rfind('@');		/* drop "user:password@" */
+	if(pos != std::string::npos) host = host.substr(pos + 1);
+
+	return host;
+}
+
+
+CRtspAdmission& CRtspAdmission::instance()
+{
+	/* constructed on first use, like the logger */
+	static CRtspAdmission admission;
+	return admission;
+}
+
+CRtspAdmission::CRtspAdmission()
+{
+	if(config_.burst < 1) config_.burst = 1;
+	tokens_ = config_.burst;
+	refill_tick_ = GetTickCount();
+}
+
+void CRtspAdmission::set_config(const SLive_RtspAdmissionConfig& config)
+{
+	mutex_.get_mutex();
+	config_ = config;
+	if(config_.burst < 1) config_.burst = 1;		/* a grant takes a whole token, a shallower bucket would never hold one */
+	if(tokens_ > config_.burst) tokens_ = config_.burst;
+	grant_locked();		/* the limits may have been raised */
+	mutex_.release_mutex();
+}
+
+SRtspAdmissionTicket* CRtspAdmission::enqueue(const char* url, ELive_RtspPriority priority, unsigned stream_id, rtsp_admission_grant_proc* on_grant, void* client_data)
+{
+	SRtspAdmissionTicket* ticket = new SRtspAdmissionTicket;
+	ticket->host = rtsp_url_host(url);
+	ticket->priority = priority;
+	ticket->stream_id = stream_id;
+	ticket->on_grant = on_grant;
+	ticket->client_data = client_data;
+	ticket->granted = false;
+	ticket->reclaimed = false;
+	ticket->granted_tick = 0;
+	ticket->jitter_ms = 0;
+
+	mutex_.get_mutex();
+	std::list<SRtspAdmissionTicket*>::iterator it = waiting_.begin();
+	while(it != waiting_.end() && (*it)->priority <= priority) ++it;
+	waiting_.insert(it, ticket);
+	grant_locked();
+	mutex_.release_mutex();
+
+	return ticket;
+}
+
+bool CRtspAdmission::poll(SRtspAdmissionTicket* ticket, DWORD& retry_ms)
+{
+	mutex_.get_mutex();
+	grant_locked();
+
+	/* only the head of the queue waits for tokens, everybody else is woken by grant_locked() */
+	bool granted = ticket->granted;
+	retry_ms = (!granted && ticket == waiting_.front()) ? next_token_ms_locked() : RTSP_ADMISSION_IDLE_WAIT;
+	mutex_.release_mutex();
+
+	return granted;
+}
+
+void CRtspAdmission::release(SRtspAdmissionTicket* ticket)
+{
+	if(NULL == ticket) return;
+
+	mutex_.get_mutex();
+	if(!ticket->granted)
+	{
+		waiting_.remove(ticket);		/* stopped while still queued */
+	}
+	else if(!ticket->reclaimed)
+	{
+		active_.remove(ticket);
+		give_back_locked(ticket);
+	}
+	grant_locked();
+	mutex_.release_mutex();
+
+	delete ticket;
+}
+
+void CRtspAdmission::load_timing(const SLive_RtspStartupTiming& shared, SLive_RtspStartupTiming& timing)
+{
+	mutex_.get_mutex();
+	timing = shared;
+	mutex_.release_mutex();
+}
+
+void CRtspAdmission::store_timing(SLive_RtspStartupTiming& shared, const SLive_RtspStartupTiming& timing)
+{
+	mutex_.get_mutex();
+	shared = timing;
+	mutex_.release_mutex();
+}
+
+void CRtspAdmission::grant_locked()
+{
+	DWORD now = GetTickCount();
+	refill_locked(now);
+	reclaim_locked(now);
+
+	std::list<SRtspAdmissionTicket*>::iterator it = waiting_.begin();
+	while(it != waiting_.end())
+	{
+		if(config_.max_handshakes > 0 && (int)active_.size() >= config_.max_handshakes) break;
+		if(config_.handshakes_per_second > 0 && tokens_ < 1.0) break;
+
+		SRtspAdmissionTicket* ticket = *it;
+		int& host_active = active_per_host_[ticket->host];
+		if(config_.max_handshakes_per_host > 0 && host_active >= config_.max_handshakes_per_host)
+		{
+			++it;		/* this host is busy, a stream on another host may still go */
+			continue;
+		}
+
+		if(config_.handshakes_per_second > 0) tokens_ -= 1.0;
+		++host_active;
+		ticket->granted = true;
+		ticket->granted_tick = now;
+		ticket->jitter_ms = (config_.jitter_ms > 0) ? (int)(((ticket->stream_id * 2654435761u) ^ now) % (unsigned)config_.jitter_ms) : 0;
+		active_.push_back(ticket);
+		it = waiting_.erase(it);
+
+		if(NULL != ticket->on_grant) ticket->on_grant(ticket->client_data);
+	}
+}
+
+void CRtspAdmission::refill_locked(DWORD now)
+{
+	if(config_.handshakes_per_second > 0)
+	{
+		tokens_ += (now - refill_tick_) * config_.handshakes_per_second / 1000.0;
+		if(tokens_ > config_.burst) tokens_ = config_.burst;
+	}
+	refill_tick_ = now;
+}
+
+void CRtspAdmission::reclaim_locked(DWORD now)
+{
+	if(config_.handshake_timeout_ms <= 0) return;
+
+	std::list<SRtspAdmissionTicket*>::iterator it = active_.begin();
+	while(it != active_.end())
+	{
+		SRtspAdmissionTicket* ticket = *it;
+		if(now - ticket->granted_tick > (DWORD)config_.handshake_timeout_ms)
+		{
+			/* the stream still owns the ticket and frees it in release() */
+			ticket->reclaimed = true;
+			give_back_locked(ticket);
+			it = active_.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void CRtspAdmission::give_back_locked(SRtspAdmissionTicket* ticket)
+{
+	std::map<std::string, int>::iterator it = active_per_host_.find(ticket->host);
+	if(it == active_per_host_.end()) return;
+
+	if(--it->second <= 0)
+	{
+		active_per_host_.erase(it);
+	}
+}
+
+DWORD CRtspAdmission::next_token_ms_locked() const
+{
+	if(config_.handshakes_per_second <= 0 || tokens_ >= 1.0)
+	{
+		return RTSP_ADMISSION_IDLE_WAIT;		/* waiting for a slot, a release wakes us */
+	}
+
+	DWORD wait_ms = (DWORD)((1.0 - tokens_) * 1000.0 / config_.handshakes_per_second) + 1;
+	return wait_ms < RTSP_ADMISSION_IDLE_WAIT ? wait_ms : RTSP_ADMISSION_IDLE_WAIT;
+}
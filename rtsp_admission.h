@@ -0,0 +1,67 @@
+#pragma once
+
+/* Startup admission control.
+ * Every loop thread asks for a handshake slot before it connects and sends DESCRIBE, and gives the slot back
+ * once PLAY has been answered (or the stream died).  Slots are limited globally and per host, paced by a
+ * token bucket, and handed out by priority class, then in arrival order.
+ * Nothing here blocks: a queued loop keeps running and is told about its grant through "on_grant", or polls
+ * again when the next token is due. */
+
+#include <list>
+#include <map>
+
+#include "parse_rtsp.h"
+
+/* runs under the admission lock, on whichever thread made the grant: it may only wake the owner up */
+typedef void rtsp_admission_grant_proc(void* client_data);
+
+typedef struct SRtspAdmissionTicket
+{
+	std::string host;
+	ELive_RtspPriority priority;
+	unsigned stream_id;
+	rtsp_admission_grant_proc* on_grant;
+	void* client_data;
+	bool granted;
+	bool reclaimed;					//handshake timed out, the slot was already given back
+	DWORD granted_tick;
+	int jitter_ms;					//how long to hold back after the grant, so that granted streams do not connect in lockstep
+}SRtspAdmissionTicket;
+
+class CRtspAdmission
+{
+public:
+	static CRtspAdmission& instance();
+
+	void set_config(const SLive_RtspAdmissionConfig& config);
+
+	/* queues a handshake; "on_grant" may run before enqueue() returns */
+	SRtspAdmissionTicket* enqueue(const char* url, ELive_RtspPriority priority, unsigned stream_id, rtsp_admission_grant_proc* on_grant, void* client_data);
+	/* true once the handshake may start; otherwise call again after "retry_ms" at the latest (tokens refill with time, nobody signals that) */
+	bool poll(SRtspAdmissionTicket* ticket, DWORD& retry_ms);
+	/* granted or still queued; "on_grant" does not run any more once this returns */
+	void release(SRtspAdmissionTicket* ticket);
+
+	/* the startup timing is written by the loop thread and read by the user, both go through the admission lock */
+	void load_timing(const SLive_RtspStartupTiming& shared, SLive_RtspStartupTiming& timing);
+	void store_timing(SLive_RtspStartupTiming& shared, const SLive_RtspStartupTiming& timing);
+
+private:
+	CRtspAdmission();
+
+	void grant_locked();
+	void refill_locked(DWORD now);
+	void reclaim_locked(DWORD now);
+	void give_back_locked(SRtspAdmissionTicket* ticket);
+	DWORD next_token_ms_locked() const;
+
+	CClientMutex mutex_;
+	SLive_RtspAdmissionConfig config_;
+	std::list<SRtspAdmissionTicket*> waiting_;		//sorted by priority, then arrival
+	std::list<SRtspAdmissionTicket*> active_;
+	std::map<std::string, int> active_per_host_;
+	double tokens_;
+	DWORD refill_tick_;
+};
+
+std::string rtsp_url_host(const char* url);
@@ -0,0 +1,279 @@
+#include <string.h>
+#include <process.h>
+
+#include "rtsp_capture.h"
+
+unsigned __int64 rtsp_capture_clock_us()
+{
+	static LONGLONG frequency = 0;
+	if(0 == frequency)
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency = f.QuadPart;
+	}
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (unsigned __int64)(counter.QuadPart / frequency) * 1000000 + (unsigned __int64)(counter.QuadPart % frequency) * 1000000 / frequency;
+}
+
+
+CRtspCaptureWriter::CRtspCaptureWriter()
+	: file_(NULL),
+	start_us_(0),
+	dropped_(0),
+	full_(RTSP_CAPTURE_BLOCK_COUNT),
+	free_(RTSP_CAPTURE_BLOCK_COUNT),
+	current_(-1),
+	current_size_(0),
+	current_tick_(0),
+	thread_(NULL),
+	wakeup_(NULL),
+	stop_(0)
+{
+}
+
+CRtspCaptureWriter::~CRtspCaptureWriter()
+{
+	close();
+
+	for(size_t i = 0; i < blocks_.size(); ++i)
+	{
+		delete[] blocks_[i];
+	}
+}
+
+bool CRtspCaptureWriter::open(const char* path)
+{
+	close();
+
+	if(0 != fopen_s(&file_, path, "wb") || NULL == file_)
+	{
+		file_ = NULL;
+		return false;
+	}
+
+	/* the blocks are kept from one capture to the next; all of them are back in "free_" once the writer has stopped */
+	if(blocks_.empty())
+	{
+		for(int i = 0; i < RTSP_CAPTURE_BLOCK_COUNT; ++i)
+		{
+			blocks_.push_back(new unsigned char[RTSP_CAPTURE_BLOCK_SIZE]);
+			block_sizes_.push_back(0);
+			free_.push(i);
+		}
+	}
+
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+
+	SRtspCaptureHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RTSP_CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = RTSP_CAPTURE_VERSION;
+	header.header_size = sizeof(header);
+	header.start_time_us = ((((unsigned __int64)ft.dwHighDateTime << 32) | ft.dwLowDateTime) - 116444736000000000ULL) / 10;
+	fwrite(&header, sizeof(header), 1, file_);
+	fflush(file_);
+
+	dropped_ = 0;
+	stop_ = 0;
+	wakeup_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+	thread_ = (NULL != wakeup_) ? (HANDLE)_beginthreadex(NULL, 0, writer_thread, this, 0, NULL) : NULL;
+	if(NULL == thread_)
+	{
+		if(NULL != wakeup_) CloseHandle(wakeup_);
+		wakeup_ = NULL;
+		fclose(file_);
+		file_ = NULL;
+		return false;
+	}
+
+	start_us_ = rtsp_capture_clock_us();
+	return true;
+}
+
+void CRtspCaptureWriter::close()
+{
+	if(NULL == file_) return;
+
+	/* everything handed over before "stop_" is written before the thread exits */
+	if(current_ >= 0) hand_over();
+	InterlockedExchange(&stop_, 1);
+	SetEvent(wakeup_);
+	WaitForSingleObject(thread_, INFINITE);
+	CloseHandle(thread_);
+	thread_ = NULL;
+	CloseHandle(wakeup_);
+	wakeup_ = NULL;
+
+	fclose(file_);
+	file_ = NULL;
+}
+
+void CRtspCaptureWriter::write(ERtspCaptureType type, unsigned subsession, const void* data, unsigned size)
+{
+	if(NULL == file_) return;
+
+	unsigned padded = sizeof(SRtspCaptureRecord) + ((size + 7) & ~7u);
+	if(current_ >= 0 && current_size_ + padded > RTSP_CAPTURE_BLOCK_SIZE) hand_over();
+	if(padded > RTSP_CAPTURE_BLOCK_SIZE || (current_ < 0 && !take_block()))
+	{
+		++dropped_;
+		return;
+	}
+
+	SRtspCaptureRecord record;
+	record.type = (unsigned short)type;
+	record.subsession = (unsigned short)subsession;
+	record.length = size;
+	record.arrival_us = rtsp_capture_clock_us() - start_us_;
+
+	unsigned char* block = blocks_[current_] + current_size_;
+	memcpy(block, &record, sizeof(record));
+	memcpy(block + sizeof(record), data, size);
+	memset(block + sizeof(record) + size, 0, padded - sizeof(record) - size);
+	current_size_ += padded;
+}
+
+void CRtspCaptureWriter::flush_if_due()
+{
+	if(current_ >= 0 && GetTickCount() - current_tick_ >= RTSP_CAPTURE_FLUSH_MS) hand_over();
+}
+
+bool CRtspCaptureWriter::take_block()
+{
+	if(!free_.pop(current_))
+	{
+		current_ = -1;
+		return false;
+	}
+
+	current_size_ = 0;
+	current_tick_ = GetTickCount();
+	return true;
+}
+
+void CRtspCaptureWriter::hand_over()
+{
+	block_sizes_[current_] = current_size_;
+	full_.push(current_);		/* cannot be full, there are no more blocks than ring entries */
+	current_ = -1;
+	SetEvent(wakeup_);
+}
+
+unsigned __stdcall CRtspCaptureWriter::writer_thread(void* param)
+{
+	CRtspCaptureWriter* writer = (CRtspCaptureWriter*)param;
+
+	while(true)
+	{
+		WaitForSingleObject(writer->wakeup_, INFINITE);
+		bool stopping = 0 != writer->stop_;
+
+		int block;
+		while(writer->full_.pop(block))
+		{
+			/* flushed block by block, so what was handed over survives a crash of the process */
+			fwrite(writer->blocks_[block], 1, writer->block_sizes_[block], writer->file_);
+			fflush(writer->file_);
+			writer->free_.push(block);
+		}
+
+		if(stopping) break;
+	}
+
+	return 0;
+}
+
+
+CRtspCaptureReader::CRtspCaptureReader()
+	: file_(INVALID_HANDLE_VALUE),
+	mapping_(NULL),
+	view_(NULL),
+	size_(0),
+	offset_(0)
+{
+}
+
+CRtspCaptureReader::~CRtspCaptureReader()
+{
+	close();
+}
+
+bool CRtspCaptureReader::open(const char* path)
+{
+	close();
+
+	file_ = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(INVALID_HANDLE_VALUE == file_) return false;
+
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file_, &size) || size.QuadPart < (LONGLONG)sizeof(SRtspCaptureHeader))
+	{
+		close();
+		return false;
+	}
+	size_ = (unsigned __int64)size.QuadPart;
+
+	mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(NULL != mapping_)
+	{
+		view_ = (const unsigned char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+	}
+	if(NULL == view_)
+	{
+		close();
+		return false;
+	}
+
+	const SRtspCaptureHeader* header = (const SRtspCaptureHeader*)view_;
+	if(0 != memcmp(header->magic, RTSP_CAPTURE_MAGIC, sizeof(header->magic)) || RTSP_CAPTURE_VERSION != header->version
+		|| header->header_size < sizeof(SRtspCaptureHeader) || header->header_size > size_)
+	{
+		close();
+		return false;
+	}
+
+	rewind();
+	return true;
+}
+
+void CRtspCaptureReader::close()
+{
+	if(NULL != view_)
+	{
+		UnmapViewOfFile(view_);
+		view_ = NULL;
+	}
+	if(NULL != mapping_)
+	{
+		CloseHandle(mapping_);
+		mapping_ = NULL;
+	}
+	if(INVALID_HANDLE_VALUE != file_)
+	{
+		CloseHandle(file_);
+		file_ = INVALID_HANDLE_VALUE;
+	}
+	size_ = 0;
+	offset_ = 0;
+}
+
+bool CRtspCaptureReader::next(SRtspCaptureRecord& record, const unsigned char*& payload)
+{
+	if(NULL == view_ || offset_ + sizeof(SRtspCaptureRecord) > size_) return false;
+
+	memcpy(&record, view_ + offset_, sizeof(record));
+	if(offset_ + sizeof(SRtspCaptureRecord) + record.length > size_) return false;	/* cut short while capturing */
+
+	payload = view_ + offset_ + sizeof(SRtspCaptureRecord);
+	offset_ += sizeof(SRtspCaptureRecord) + ((record.length + 7) & ~7u);
+	return true;
+}
+
+void CRtspCaptureReader::rewind()
+{
+	offset_ = (NULL != view_) ? ((const SRtspCaptureHeader*)view_)->header_size : 0;
+}
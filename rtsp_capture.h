@@ -0,0 +1,117 @@
+#pragma once
+
+/* Capture files: one RTSP session as it reached the client, for replaying it without the camera.
+ * Layout (little endian, every record 8 byte aligned so a mapped file can be walked in place):
+ *   SRtspCaptureHeader
+ *   { SRtspCaptureRecord, payload, zero padding up to the next multiple of 8 } ...
+ * The first SDP record describes the session; RTSP records are the results of the client's commands as text
+ * ("<COMMAND> <result code> <details>"); RTP records are the packets exactly as live555 read them, tagged with
+ * the index of their subsession in the SDP. */
+
+#include <stdio.h>
+#include <vector>
+
+#include "parse_rtsp.h"
+#include "rtsp_spsc_ring.h"
+
+#define RTSP_CAPTURE_MAGIC		"RTSPCAP1"
+#define RTSP_CAPTURE_VERSION	1
+
+typedef enum ERtspCaptureType
+{
+	RTSP_CAPTURE_SDP = 1,
+	RTSP_CAPTURE_RTSP,
+	RTSP_CAPTURE_RTP,
+	RTSP_CAPTURE_RTCP				//reserved, live555 has no hook for incoming RTCP
+}ERtspCaptureType;
+
+typedef struct SRtspCaptureHeader
+{
+	char magic[8];
+	unsigned version;
+	unsigned header_size;			//sizeof(SRtspCaptureHeader), records start here
+	unsigned __int64 start_time_us;	//wall clock at the start of the capture, us since 1970
+	unsigned __int64 reserved;
+}SRtspCaptureHeader;
+
+typedef struct SRtspCaptureRecord
+{
+	unsigned short type;			//ERtspCaptureType
+	unsigned short subsession;		//index of the "m=" section, RTP records only
+	unsigned length;				//payload bytes, without the padding
+	unsigned __int64 arrival_us;	//since the start of the capture
+}SRtspCaptureRecord;
+
+/* monotonic microseconds (QueryPerformanceCounter) */
+unsigned __int64 rtsp_capture_clock_us();
+
+#define RTSP_CAPTURE_BLOCK_SIZE		(256*1024)
+#define RTSP_CAPTURE_BLOCK_COUNT	16			//what the disk may fall behind by before records are dropped
+#define RTSP_CAPTURE_FLUSH_MS		500			//a crash loses at most about this much of the capture
+
+/* event loop thread only.  Records are gathered into blocks that a writer thread of its own puts on disk (and flushes),
+ * so a slow disk never holds up the network; a block is handed over when it is full or RTSP_CAPTURE_FLUSH_MS after its
+ * first record.  When the writer is more than RTSP_CAPTURE_BLOCK_COUNT blocks behind, records are dropped and counted */
+class CRtspCaptureWriter
+{
+public:
+	CRtspCaptureWriter();
+	~CRtspCaptureWriter();
+
+	bool open(const char* path);
+	void close();
+	__inline bool is_open() const {return NULL != file_;}
+
+	void write(ERtspCaptureType type, unsigned subsession, const void* data, unsigned size);
+	/* hands a partly filled block to the writer once it is old enough; call it now and then from the loop */
+	void flush_if_due();
+	__inline unsigned __int64 dropped_records() const {return dropped_;}
+
+private:
+	CRtspCaptureWriter(const CRtspCaptureWriter&);
+	CRtspCaptureWriter& operator=(const CRtspCaptureWriter&);
+
+	bool take_block();
+	void hand_over();
+	static unsigned __stdcall writer_thread(void* param);
+
+	FILE* file_;
+	unsigned __int64 start_us_;
+	unsigned __int64 dropped_;
+
+	std::vector<unsigned char*> blocks_;
+	std::vector<unsigned> block_sizes_;
+	CSpscRing<int> full_;				//loop -> writer thread
+	CSpscRing<int> free_;				//writer thread -> loop
+	int current_;						//block being filled, -1 = none
+	unsigned current_size_;
+	DWORD current_tick_;				//when its first record came
+
+	HANDLE thread_;
+	HANDLE wakeup_;						//auto reset, a block was handed over (or close())
+	volatile LONG stop_;
+};
+
+/* walks a mapped capture file front to back; "payload" points into the mapping and stays valid until close() */
+class CRtspCaptureReader
+{
+public:
+	CRtspCaptureReader();
+	~CRtspCaptureReader();
+
+	bool open(const char* path);
+	void close();
+
+	bool next(SRtspCaptureRecord& record, const unsigned char*& payload);
+	void rewind();
+
+private:
+	CRtspCaptureReader(const CRtspCaptureReader&);
+	CRtspCaptureReader& operator=(const CRtspCaptureReader&);
+
+	HANDLE file_;
+	HANDLE mapping_;
+	const unsigned char* view_;
+	unsigned __int64 size_;
+	unsigned __int64 offset_;
+};
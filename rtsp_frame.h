@@ -0,0 +1,456 @@
+#pragma once
+
+/* Per-frame work of the sink path.
+ * Only depends on the public types, so recorded payloads can be pushed through it without live555 or a network. */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "parse_rtsp.h"
+
+typedef enum ERtspSinkCodec
+{
+	RTSP_SINK_CODEC_NONE = 0,		//not delivered to the callback
+	RTSP_SINK_CODEC_H264,
+	RTSP_SINK_CODEC_MP2T,
+	RTSP_SINK_CODEC_PCMA,
+	RTSP_SINK_CODEC_AAC
+}ERtspSinkCodec;
+
+/* once per subsession */
+__inline ERtspSinkCodec rtsp_sink_codec(const char* medium_name, const char* codec_name)
+{
+	if(!strcmp(medium_name, "video"))
+	{
+		if(!strcmp(codec_name, "H264")) return RTSP_SINK_CODEC_H264;
+		if(!strcmp(codec_name, "MP2T")) return RTSP_SINK_CODEC_MP2T;
+	}
+	else if(!strcmp(medium_name, "audio"))
+	{
+		if(!strcmp(codec_name, "PCMA")) return RTSP_SINK_CODEC_PCMA;
+		if(!strcmp(codec_name, "MPEG4-GENERIC")) return RTSP_SINK_CODEC_AAC;
+	}
+
+	return RTSP_SINK_CODEC_NONE;
+}
+
+/* the metadata shared by every frame of a subsession; per frame only pts and is_i_frame change */
+__inline void rtsp_frame_info_template(ERtspSinkCodec codec, int channels, int samples_rate, SLive_RtspDataInfo& info)
+{
+	info = SLive_RtspDataInfo();
+
+	switch(codec)
+	{
+	case RTSP_SINK_CODEC_H264:
+		info.data_type = LIVE_RTSP_DATA_TYPE_V;
+		info.video_param.video_encode_type = LIVE_ENCODE_V_H264;
+		break;
+	case RTSP_SINK_CODEC_MP2T:
+		info.video_param.video_encode_type = LIVE_ENCODE_V_MP2T;
+		break;
+	case RTSP_SINK_CODEC_PCMA:
+	case RTSP_SINK_CODEC_AAC:
+		info.data_type = LIVE_RTSP_DATA_TYPE_A;
+		info.audio_param.audio_encode_type = (RTSP_SINK_CODEC_PCMA == codec) ? LIVE_ENCODE_A_PCMA : LIVE_ENCODE_A_AAC;
+		info.audio_param.channels = channels;
+		info.audio_param.samples_rate = samples_rate;
+		break;
+	default:
+		break;
+	}
+}
+
+/* SLive_RtspFrameStats counters: written by the loop thread, read by get_frame_stats() on any thread */
+__inline void rtsp_stat_add(unsigned __int64& counter, unsigned __int64 value)
+{
+	InterlockedExchangeAdd64((volatile LONGLONG*)&counter, (LONGLONG)value);
+}
+
+__inline void rtsp_stat_set(unsigned __int64& counter, unsigned __int64 value)
+{
+	InterlockedExchange64((volatile LONGLONG*)&counter, (LONGLONG)value);
+}
+
+__inline unsigned __int64 rtsp_stat_load(unsigned __int64& counter)
+{
+	return (unsigned __int64)InterlockedCompareExchange64((volatile LONGLONG*)&counter, 0, 0);
+}
+
+/* presentation time in 90KHz ticks, integer only */
+__inline __int64 rtsp_pts_90k(long tv_sec, long tv_usec)
+{
+	return (__int64)tv_sec * 90000 + (__int64)tv_usec * 9 / 100;
+}
+
+/* IDR slice, SPS or PPS */
+__inline bool rtsp_h264_is_key(const unsigned char* data, unsigned size)
+{
+	if(0 == size) return false;
+
+	unsigned nal_type = data[0] & 0x1f;
+	return 5 == nal_type || 7 == nal_type || 8 == nal_type;
+}
+
+__inline void rtsp_stamp_frame(ERtspSinkCodec codec, const unsigned char* data, unsigned size, long tv_sec, long tv_usec,
+	SLive_RtspDataInfo& info)
+{
+	switch(codec)
+	{
+	case RTSP_SINK_CODEC_H264:
+		info.video_param.pts = rtsp_pts_90k(tv_sec, tv_usec);
+		info.video_param.is_i_frame = rtsp_h264_is_key(data, size);
+		break;
+	case RTSP_SINK_CODEC_PCMA:
+	case RTSP_SINK_CODEC_AAC:
+		info.audio_param.pts = rtsp_pts_90k(tv_sec, tv_usec);
+		break;
+	default:
+		break;
+	}
+}
+
+/* integrity of the consecutive frames of one subsession */
+typedef struct SRtspIntegrityState
+{
+	bool in_recovery;				//video was damaged, everything up to the next IDR slice depends on it
+
+	SRtspIntegrityState() : in_recovery(false) {}
+}SRtspIntegrityState;
+
+__inline ELive_RtspFrameIntegrity rtsp_frame_integrity(SRtspIntegrityState& state, ERtspSinkCodec codec,
+	const unsigned char* data, unsigned size, bool damaged)
+{
+	if(RTSP_SINK_CODEC_H264 != codec) return damaged ? LIVE_FRAME_DAMAGED : LIVE_FRAME_COMPLETE;
+
+	if(damaged)
+	{
+		state.in_recovery = true;
+		return LIVE_FRAME_DAMAGED;
+	}
+	if(!state.in_recovery || 0 == size) return LIVE_FRAME_COMPLETE;
+
+	unsigned nal_type = data[0] & 0x1f;
+	if(5 == nal_type)
+	{
+		state.in_recovery = false;
+		return LIVE_FRAME_COMPLETE;
+	}
+	if(7 == nal_type || 8 == nal_type) return LIVE_FRAME_COMPLETE;	/* parameter sets don't reference anything */
+
+	return LIVE_FRAME_DEPENDS_ON_DAMAGED;
+}
+
+/* RTP sequence continuity of one subsession.
+ * live555 only tells the sink the sequence number of the last packet of a frame, and drops a fragmented frame that lost a
+ * packet on its own, so whatever is missing lies between the last packet of the previous frame and the last packet of this
+ * one.  Every packet read is marked in a window as it comes in (in any order); once live555 has delivered the frame, in
+ * order, the packets of that range must all be marked */
+#define RTSP_SEQ_WINDOW		4096	/* packets; a larger range (a huge loss, or a frame this many packets long) counts as a loss */
+
+typedef struct SRtspSeqTracker
+{
+	bool have_ssrc;
+	unsigned ssrc;
+	bool have_candidate;			//a packet of another source: believed once a second one has the same SSRC
+	unsigned candidate_ssrc;
+	unsigned short candidate_seq;
+	bool started;					//"last_seq" is set
+	unsigned short last_seq;		//last packet of the latest frame, everything up to it has been checked
+	unsigned unidentified;			//packets read without a header of ours: over TCP, live555 shows its read handler only the
+									//last piece of a packet it had to read in several.  Each one excuses one missing number
+	unsigned __int64 received[RTSP_SEQ_WINDOW / 64];
+
+	SRtspSeqTracker() : have_ssrc(false), ssrc(0), have_candidate(false), candidate_ssrc(0), candidate_seq(0), started(false),
+		last_seq(0), unidentified(0) {memset(received, 0, sizeof(received));}
+}SRtspSeqTracker;
+
+__inline void rtsp_seq_mark(SRtspSeqTracker& tracker, unsigned short seq)
+{
+	tracker.received[(seq % RTSP_SEQ_WINDOW) / 64] |= (unsigned __int64)1 << (seq % 64);
+}
+
+/* every RTP packet as it is read, before live555 reorders it */
+__inline void rtsp_seq_received(SRtspSeqTracker& tracker, const unsigned char* packet, unsigned size)
+{
+	bool header = size >= 12 && 2 == (packet[0] >> 6);
+	unsigned short seq = header ? (unsigned short)((packet[2] << 8) | packet[3]) : 0;
+	unsigned ssrc = header ? ((unsigned)packet[8] << 24) | ((unsigned)packet[9] << 16) | ((unsigned)packet[10] << 8) | packet[11] : 0;
+
+	if(header && !tracker.have_ssrc)
+	{
+		tracker.have_ssrc = true;
+		tracker.ssrc = ssrc;
+	}
+	else if(!header || ssrc != tracker.ssrc)
+	{
+		if(header && tracker.have_candidate && ssrc == tracker.candidate_ssrc)
+		{
+			/* a new source numbers its packets afresh: check it from its first packet on */
+			tracker.ssrc = ssrc;
+			tracker.have_candidate = false;
+			memset(tracker.received, 0, sizeof(tracker.received));
+			tracker.unidentified = 0;
+			tracker.started = true;
+			tracker.last_seq = (unsigned short)(tracker.candidate_seq - 1);
+			rtsp_seq_mark(tracker, tracker.candidate_seq);
+			rtsp_seq_mark(tracker, seq);
+			return;
+		}
+
+		if(header)
+		{
+			tracker.have_candidate = true;
+			tracker.candidate_ssrc = ssrc;
+			tracker.candidate_seq = seq;
+		}
+		++tracker.unidentified;
+		return;
+	}
+
+	tracker.have_candidate = false;
+	if(tracker.started && (short)(seq - tracker.last_seq) <= 0) return;		/* a duplicate, or too late: live555 has gone past it */
+
+	rtsp_seq_mark(tracker, seq);
+}
+
+/* once per delivered frame, with the sequence number of its last packet; true when a packet before or inside it is missing */
+__inline bool rtsp_seq_frame_lost(SRtspSeqTracker& tracker, unsigned short frame_last_seq)
+{
+	if(!tracker.started)
+	{
+		/* the first frame: nothing before it to check.  Forget what it was made of, keep what came in after it */
+		for(unsigned i = 0; i < RTSP_SEQ_WINDOW / 2; ++i)
+		{
+			unsigned short seq = (unsigned short)(frame_last_seq - i);
+			tracker.received[(seq % RTSP_SEQ_WINDOW) / 64] &= ~((unsigned __int64)1 << (seq % 64));
+		}
+		tracker.started = true;
+		tracker.last_seq = frame_last_seq;
+		return false;
+	}
+
+	short range = (short)(frame_last_seq - tracker.last_seq);
+	if(range <= 0) return false;		/* more of the same packet (aggregated NAL units), or a frame of before a restart */
+
+	unsigned missing = 0;
+	for(unsigned short seq = (unsigned short)(tracker.last_seq + 1); ; ++seq)
+	{
+		unsigned __int64& word = tracker.received[(seq % RTSP_SEQ_WINDOW) / 64];
+		unsigned __int64 bit = (unsigned __int64)1 << (seq % 64);
+		if(0 == (word & bit)) ++missing;
+		word &= ~bit;
+
+		if(seq == frame_last_seq) break;
+	}
+	tracker.last_seq = frame_last_seq;
+
+	unsigned excused = (missing < tracker.unidentified) ? missing : tracker.unidentified;
+	tracker.unidentified -= excused;
+
+	return range > RTSP_SEQ_WINDOW || missing > excused;
+}
+
+/* which key frame request the server advertised for a subsession ("a=rtcp-fb:<pt> nack pli" / "a=rtcp-fb:<pt> ccm fir") */
+typedef enum ERtspKeyframeFeedback
+{
+	RTSP_KEYFRAME_FEEDBACK_NONE = 0,
+	RTSP_KEYFRAME_FEEDBACK_PLI,
+	RTSP_KEYFRAME_FEEDBACK_FIR
+}ERtspKeyframeFeedback;
+
+/* "media_sdp" is the subsession's own part of the SDP (from its "m=" line on), only the attributes for its payload
+ * type or for every payload type ("a=rtcp-fb:* ...") count */
+__inline ERtspKeyframeFeedback rtsp_sdp_keyframe_feedback(const char* media_sdp, unsigned payload_type)
+{
+	char pt[16];
+	_snprintf_s(pt, sizeof(pt), _TRUNCATE, "%u", payload_type);
+
+	ERtspKeyframeFeedback feedback = RTSP_KEYFRAME_FEEDBACK_NONE;
+	for(const char* line = strstr(media_sdp, "a=rtcp-fb:"); NULL != line; line = strstr(line + 1, "a=rtcp-fb:"))
+	{
+		const char* end = strchr(line, '\n');
+		std::string attr = (NULL != end) ? std::string(line, end - line) : std::string(line);
+
+		std::string::size_type space = attr.find(' ');
+		if(std::string::npos == space) continue;
+		std::string attr_pt = attr.substr(10, space - 10);
+		if(attr_pt != pt && attr_pt != "*") continue;
+
+		if(std::string::npos != attr.find("nack pli")) return RTSP_KEYFRAME_FEEDBACK_PLI;
+		if(std::string::npos != attr.find("ccm fir")) feedback = RTSP_KEYFRAME_FEEDBACK_FIR;
+	}
+
+	return feedback;
+}
+
+/* reduced-size RTCP (RFC 5506, "a=rtcp-rsize"): feedback may go out on its own instead of in a compound packet */
+__inline bool rtsp_sdp_rtcp_rsize(const char* media_sdp)
+{
+	return NULL != strstr(media_sdp, "a=rtcp-rsize");
+}
+
+/* how the SRTP keys of a protected subsession ("m=... RTP/SAVP") are exchanged */
+typedef enum ERtspSrtpKeying
+{
+	RTSP_SRTP_KEYING_NONE = 0,		//plain RTP
+	RTSP_SRTP_KEYING_MIKEY,			//"a=key-mgmt:mikey", what live555 implements
+	RTSP_SRTP_KEYING_UNSUPPORTED	//SDES "a=crypto:" or no key management at all, live555 cannot decrypt this
+}ERtspSrtpKeying;
+
+__inline ERtspSrtpKeying rtsp_sdp_srtp_keying(const char* sdp)
+{
+	if(NULL != strstr(sdp, "a=key-mgmt:mikey")) return RTSP_SRTP_KEYING_MIKEY;
+	if(NULL != strstr(sdp, "RTP/SAVP") || NULL != strstr(sdp, "a=crypto:")) return RTSP_SRTP_KEYING_UNSUPPORTED;
+
+	return RTSP_SRTP_KEYING_NONE;
+}
+
+#define RTSP_KEYFRAME_REQUEST_MAX	300		/* RR + SDES with a 255 byte CNAME + FIR */
+
+/* RTCP PLI (RFC 4585) or FIR (RFC 5104) for "media_ssrc"; returns the packet size.
+ * RFC 3550 only allows compound packets, which start with a report and carry our CNAME: with a "cname" the feedback
+ * follows an empty RR and a SDES chunk, without one (reduced-size RTCP negotiated) it goes out alone */
+__inline unsigned rtsp_build_keyframe_request(unsigned char* packet, ERtspKeyframeFeedback feedback,
+	unsigned sender_ssrc, unsigned media_ssrc, unsigned char fir_seq, const char* cname)
+{
+	if(NULL != cname)
+	{
+		unsigned cname_len = (unsigned)strlen(cname);
+		if(cname_len > 255) cname_len = 255;
+
+		/* RR without report blocks */
+		packet[0] = 0x80;													/* V=2, RC=0 */
+		packet[1] = 201;													/* PT=RR */
+		packet[2] = 0;
+		packet[3] = 1;
+		for(int i = 0; i < 4; ++i) packet[4 + i] = (unsigned char)(sender_ssrc >> (24 - 8*i));
+
+		/* SDES, one chunk: SSRC, CNAME item, then at least one null octet up to the next 32 bit boundary */
+		unsigned chunk = 4 + ((2 + cname_len + 1 + 3) & ~3u);
+		unsigned char* sdes = packet + 8;
+		memset(sdes, 0, 4 + chunk);
+		sdes[0] = 0x81;														/* V=2, SC=1 */
+		sdes[1] = 202;														/* PT=SDES */
+		sdes[3] = (unsigned char)(chunk / 4);
+		for(int i = 0; i < 4; ++i) sdes[4 + i] = (unsigned char)(sender_ssrc >> (24 - 8*i));
+		sdes[8] = 1;														/* CNAME */
+		sdes[9] = (unsigned char)cname_len;
+		memcpy(sdes + 10, cname, cname_len);
+
+		unsigned head = 8 + 4 + chunk;
+		return head + rtsp_build_keyframe_request(packet + head, feedback, sender_ssrc, media_ssrc, fir_seq, NULL);
+	}
+
+	unsigned words = (RTSP_KEYFRAME_FEEDBACK_FIR == feedback) ? 4 : 2;	/* length in 32 bit words minus one */
+
+	packet[0] = (RTSP_KEYFRAME_FEEDBACK_FIR == feedback) ? 0x84 : 0x81;	/* V=2, FMT=4 (FIR) / 1 (PLI) */
+	packet[1] = 206;													/* PT=PSFB */
+	packet[2] = 0;
+	packet[3] = (unsigned char)words;
+	for(int i = 0; i < 4; ++i) packet[4 + i] = (unsigned char)(sender_ssrc >> (24 - 8*i));
+
+	if(RTSP_KEYFRAME_FEEDBACK_FIR != feedback)
+	{
+		for(int i = 0; i < 4; ++i) packet[8 + i] = (unsigned char)(media_ssrc >> (24 - 8*i));
+		return 12;
+	}
+
+	/* FIR: the media source field is unused, the target goes into the FCI entry */
+	memset(packet + 8, 0, 12);
+	for(int i = 0; i < 4; ++i) packet[12 + i] = (unsigned char)(media_ssrc >> (24 - 8*i));
+	packet[16] = fir_seq;
+	return 20;
+}
+
+/* archive download: how much media time one sink has received.
+ * The RTP timestamps advance in media time whatever the delivery speed, so the presentation time deltas add up to the
+ * position in the recording; the jump when live555 first synchronizes with RTCP is not counted */
+typedef struct SRtspArchiveClock
+{
+	bool started;
+	bool synced;
+	__int64 last_pts_us;
+	double position;
+
+	SRtspArchiveClock()
+	{
+		started = false;
+		synced = false;
+		last_pts_us = 0;
+		position = 0.0;
+	}
+}SRtspArchiveClock;
+
+__inline double rtsp_archive_advance(SRtspArchiveClock& clock, long pts_sec, long pts_usec, bool synced)
+{
+	__int64 pts_us = (__int64)pts_sec * 1000000 + pts_usec;
+
+	if(clock.started && synced == clock.synced && pts_us > clock.last_pts_us)
+	{
+		clock.position += (pts_us - clock.last_pts_us) / 1000000.0;
+	}
+	if(!clock.started || synced != clock.synced || pts_us > clock.last_pts_us)
+	{
+		clock.last_pts_us = pts_us;		/* reordered (B-)frames don't move the clock back */
+	}
+	clock.started = true;
+	clock.synced = synced;
+
+	return clock.position;
+}
+
+/* an absolute "YYYYMMDDTHHMMSS[.fff]Z" time in seconds since 1970-01-01; false when it doesn't parse */
+__inline bool rtsp_abs_time_parse(const char* time, double& seconds)
+{
+	int y, mo, d, h, mi;
+	double s;
+	if(NULL == time || 6 != sscanf(time, "%4d%2d%2dT%2d%2d%lf", &y, &mo, &d, &h, &mi, &s)) return false;
+
+	/* days since 1970-01-01 of the proleptic Gregorian calendar */
+	y -= mo <= 2;
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	double days = era * 146097.0 + doe - 719468;
+
+	seconds = days * 86400.0 + h * 3600 + mi * 60 + s;
+	return true;
+}
+
+/* seconds between two absolute times, 0 when either one doesn't parse */
+__inline double rtsp_abs_time_diff(const char* from, const char* to)
+{
+	double seconds[2];
+	if(!rtsp_abs_time_parse(from, seconds[0]) || !rtsp_abs_time_parse(to, seconds[1])) return 0.0;
+
+	return seconds[1] - seconds[0];
+}
+
+/* "time" plus "seconds" into "out" as "YYYYMMDDTHHMMSS.fffZ"; false when "time" doesn't parse */
+__inline bool rtsp_abs_time_add(const char* time, double seconds, char* out, size_t out_size)
+{
+	double base;
+	if(!rtsp_abs_time_parse(time, base)) return false;
+
+	__int64 ms = (__int64)floor((base + seconds) * 1000.0 + 0.5);
+	__int64 day_ms = ms % 86400000;
+	if(day_ms < 0) day_ms += 86400000;
+	int z = (int)((ms - day_ms) / 86400000) + 719468;
+
+	/* back from days since 1970-01-01 to the calendar */
+	int era = (z >= 0 ? z : z - 146096) / 146097;
+	int doe = z - era * 146097;
+	int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int mp = (5 * doy + 2) / 153;
+	int d = doy - (153 * mp + 2) / 5 + 1;
+	int mo = mp < 10 ? mp + 3 : mp - 9;
+	int y = yoe + era * 400 + (mo <= 2);
+
+	int day_s = (int)(day_ms / 1000);
+	_snprintf_s(out, out_size, _TRUNCATE, "%04d%02d%02dT%02d%02d%02d.%03dZ", y, mo, d, day_s / 3600, day_s / 60 % 60, day_s % 60,
+		(int)(day_ms % 1000));
+	return true;
+}
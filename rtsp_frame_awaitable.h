@@ -0,0 +1,118 @@
+#pragma once
+
+/* C++20 awaitable on top of the pull API:
+ *
+ *     SLive_RtspFrame frame = co_await client.next_frame(post_to_my_executor, my_executor);
+ *     ...
+ *     client.release_frame(frame);
+ *
+ * The frame is the slot the loop thread received into, nothing is copied on the way.  Awaiting before the first run()
+ * does not suspend and yields an empty frame (data == NULL, release_frame() ignores it); so does an await that is still
+ * pending when the client is destroyed, resumed from the destructor: the client must not be used after that. */
+
+#include "parse_rtsp.h"
+
+#ifdef RTSP_CLIENT_HAS_COROUTINES
+
+class CRtspNextFrame
+{
+public:
+	typedef void (*post_func)(std::coroutine_handle<> handle, void* executor);
+
+	CRtspNextFrame(CRTSPClient& client, post_func post, void* executor)
+		: client_(client), post_(post), executor_(executor)
+	{
+	}
+
+	bool await_ready()
+	{
+		return 1 == client_.try_pop_frames(&frame_, 1);
+	}
+
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		/* no event before the first run(): nothing would ever wake us, so go on right away with an empty frame */
+		handle_ = handle;
+		return register_wait();
+	}
+
+	SLive_RtspFrame await_resume()
+	{
+		return frame_;
+	}
+
+private:
+	/* one wait per registration, freed by whoever ends it: the callback, or the client's destructor through on_cancel() */
+	bool register_wait()
+	{
+		SLive_RtspFrameWait* wait = new SLive_RtspFrameWait;
+		wait->handle = NULL;
+		wait->cancelled = false;
+		wait->on_cancel = on_cancel;
+		wait->context = this;
+		if(!client_.register_frame_wait(wait, on_frame_event))
+		{
+			delete wait;
+			return false;
+		}
+
+		return true;		/* the coroutine may already be resumed, "this" is not touched any more */
+	}
+
+	static void CALLBACK on_frame_event(void* param, BOOLEAN /*timed_out*/)
+	{
+		SLive_RtspFrameWait* wait = (SLive_RtspFrameWait*)param;
+		CRtspNextFrame* self = (CRtspNextFrame*)wait->context;
+		CRTSPClient& client = self->client_;
+
+		/* the client is being destroyed and resumes us itself */
+		if(!client.begin_frame_wait(wait)) return;
+
+		/* woken for a frame somebody else took: wait again, or give up with an empty frame if that fails */
+		bool resume = 1 == client.try_pop_frames(&self->frame_, 1) || !self->register_wait();
+		client.end_frame_wait();
+
+		HANDLE handle = wait->handle;
+		delete wait;
+		UnregisterWait(handle);		/* non-blocking form, allowed from inside the callback */
+
+		if(resume)
+		{
+			self->resume();
+		}
+	}
+
+	static void on_cancel(SLive_RtspFrameWait* wait)
+	{
+		CRtspNextFrame* self = (CRtspNextFrame*)wait->context;
+		delete wait;
+
+		self->frame_ = SLive_RtspFrame();
+		self->resume();
+	}
+
+	void resume()
+	{
+		if(NULL != post_)
+		{
+			post_(handle_, executor_);
+		}
+		else
+		{
+			handle_.resume();
+		}
+	}
+
+	CRTSPClient& client_;
+	post_func post_;
+	void* executor_;
+	std::coroutine_handle<> handle_;
+	SLive_RtspFrame frame_;
+};
+
+inline CRtspNextFrame CRTSPClient::next_frame(void (*post)(std::coroutine_handle<> handle, void* executor), void* executor)
+{
+	return CRtspNextFrame(*this, post, executor);
+}
+
+#endif
@@ -0,0 +1,202 @@
+#include "rtsp_frame_queue.h"
+#include "rtsp_placement.h"
+
+CRtspFrameQueue::CRtspFrameQueue(int slot_count, unsigned slot_size, rtsp_data_callback data_cb, void* data_cb_user)
+	: numa_node_(-1),
+	slot_count_(slot_count),
+	slot_size_(slot_size),
+	free_(slot_count),
+	ready_(slot_count),
+	data_cb_(data_cb),
+	data_cb_user_(data_cb_user),
+	armed_(1),
+	closing_(false),
+	wait_callbacks_(0)
+{
+	event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+CRtspFrameQueue::~CRtspFrameQueue()
+{
+	/* a pending co_await would otherwise be woken on a closed event, or never */
+	cancel_waits();
+
+	for(size_t i = 0; i < slots_.size(); ++i)
+	{
+		rtsp_free_buffer(slots_[i]);
+	}
+
+	CloseHandle(event_);
+}
+
+void CRtspFrameQueue::attach(int numa_node)
+{
+	/* allocated by the loop thread, on its node, right before the first frame */
+	if(!slots_.empty()) return;
+
+	numa_node_ = numa_node;
+	for(int i = 0; i < slot_count_; ++i)
+	{
+		unsigned char* slot = rtsp_alloc_buffer(slot_size_, numa_node);
+		if(NULL == slot) break;
+
+		slots_.push_back(slot);
+		spare_.push_back(i);
+	}
+}
+
+int CRtspFrameQueue::acquire_slot()
+{
+	int slot = -1;
+	if(!spare_.empty())
+	{
+		slot = spare_.back();
+		spare_.pop_back();
+	}
+	else if(!free_.pop(slot))
+	{
+		slot = -1;
+	}
+
+	if(slot < 0 && NULL != data_cb_)
+	{
+		/* callback mode never queues, so it just needs one slot per sink: grow when a stream has more sinks than we guessed */
+		unsigned char* buffer = rtsp_alloc_buffer(slot_size_, numa_node_);
+		if(NULL != buffer)
+		{
+			slot = (int)slots_.size();
+			slots_.push_back(buffer);
+		}
+	}
+
+	return slot;
+}
+
+void CRtspFrameQueue::recycle_slot(int slot)
+{
+	if(slot >= 0) spare_.push_back(slot);
+}
+
+void CRtspFrameQueue::publish(int slot, unsigned frame_size, const SLive_RtspDataInfo& data_info)
+{
+	if(NULL != data_cb_)
+	{
+		/* callback mode: the callback runs on the loop thread and the slot is ours again as soon as it returns */
+		data_cb_(slots_[slot], frame_size, data_info, data_cb_user_);
+		spare_.push_back(slot);
+		return;
+	}
+
+	SLive_RtspFrame frame;
+	frame.data = slots_[slot];
+	frame.data_len = frame_size;
+	frame.data_info = data_info;
+	frame.slot = slot;
+	ready_.push(frame);		/* cannot be full, there are no more frames than slots */
+
+	if(0 != InterlockedExchange(&armed_, 0))
+	{
+		SetEvent(event_);
+	}
+}
+
+int CRtspFrameQueue::try_pop(SLive_RtspFrame* frames, int max_frames)
+{
+	int count = 0;
+	while(count < max_frames && ready_.pop(frames[count]))
+	{
+		++count;
+	}
+
+	if(count < max_frames)
+	{
+		/* drained: re-arm, then look again in case a frame was published before the producer could see "armed_" */
+		ResetEvent(event_);
+		InterlockedExchange(&armed_, 1);
+		if(!ready_.empty())
+		{
+			SetEvent(event_);
+		}
+	}
+
+	return count;
+}
+
+void CRtspFrameQueue::release(const SLive_RtspFrame& frame)
+{
+	if(frame.slot >= 0)
+	{
+		free_.push(frame.slot);
+	}
+}
+
+bool CRtspFrameQueue::add_wait(SLive_RtspFrameWait* wait, WAITORTIMERCALLBACK callback)
+{
+	/* registered under the lock, so that a callback firing before RegisterWaitForSingleObject has returned finds the wait
+	 * listed, with its handle */
+	waits_mutex_.get_mutex();
+	bool registered = !closing_ && RegisterWaitForSingleObject(&wait->handle, event_, callback, wait, INFINITE, WT_EXECUTEONLYONCE);
+	if(registered)
+	{
+		waits_.push_back(wait);
+	}
+	waits_mutex_.release_mutex();
+
+	return registered;
+}
+
+bool CRtspFrameQueue::begin_wait_callback(SLive_RtspFrameWait* wait)
+{
+	/* counted first: from here on cancel_waits() waits for end_wait_callback() before the queue goes away */
+	InterlockedIncrement(&wait_callbacks_);
+
+	waits_mutex_.get_mutex();
+	bool cancelled = wait->cancelled;
+	if(!cancelled)
+	{
+		waits_.remove(wait);
+	}
+	waits_mutex_.release_mutex();
+
+	if(cancelled)
+	{
+		InterlockedDecrement(&wait_callbacks_);
+	}
+	return !cancelled;
+}
+
+void CRtspFrameQueue::end_wait_callback()
+{
+	InterlockedDecrement(&wait_callbacks_);
+}
+
+void CRtspFrameQueue::cancel_waits()
+{
+	waits_mutex_.get_mutex();
+	closing_ = true;
+	std::list<SLive_RtspFrameWait*> waits;
+	waits.swap(waits_);
+	for(std::list<SLive_RtspFrameWait*>::iterator it = waits.begin(); it != waits.end(); ++it)
+	{
+		(*it)->cancelled = true;
+	}
+	waits_mutex_.release_mutex();
+
+	/* returns once a callback that had already started has returned; the others never run */
+	for(std::list<SLive_RtspFrameWait*>::iterator it = waits.begin(); it != waits.end(); ++it)
+	{
+		UnregisterWaitEx((*it)->handle, INVALID_HANDLE_VALUE);
+	}
+
+	/* callbacks that took their wait before we did may still be popping or registering again */
+	while(0 != wait_callbacks_)
+	{
+		Sleep(0);
+	}
+
+	/* only now, with no callback left: an awaiter resumed inline may use the queue right away */
+	for(std::list<SLive_RtspFrameWait*>::iterator it = waits.begin(); it != waits.end(); ++it)
+	{
+		(*it)->on_cancel(*it);
+	}
+}
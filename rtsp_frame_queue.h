@@ -0,0 +1,66 @@
+#pragma once
+
+/* Receive slots shared by the sinks of one stream.
+ * The sinks receive straight into a slot; a finished frame is either handed to the data callback right away
+ * (callback mode) or queued for the consumer thread until it gives the slot back (pull mode).
+ * Slots travel loop -> consumer through "ready_" and consumer -> loop through "free_", both single-producer
+ * single-consumer; "spare_" holds the slots only the loop thread knows about. */
+
+#include <list>
+#include <vector>
+
+#include "parse_rtsp.h"
+#include "rtsp_spsc_ring.h"
+
+class CRtspFrameQueue
+{
+public:
+	CRtspFrameQueue(int slot_count, unsigned slot_size, rtsp_data_callback data_cb, void* data_cb_user);
+	~CRtspFrameQueue();
+
+	/* between two runs, while no loop thread uses the queue */
+	__inline void set_callback(rtsp_data_callback data_cb, void* data_cb_user) {data_cb_ = data_cb; data_cb_user_ = data_cb_user;}
+
+	/* event loop thread; the slots stay where the first loop thread attached them */
+	void attach(int numa_node);
+	int acquire_slot();
+	void recycle_slot(int slot);
+	void publish(int slot, unsigned frame_size, const SLive_RtspDataInfo& data_info);
+	__inline unsigned char* slot_data(int slot) const {return slots_[slot];}
+	__inline unsigned slot_size() const {return slot_size_;}
+
+	/* consumer thread */
+	int try_pop(SLive_RtspFrame* frames, int max_frames);
+	void release(const SLive_RtspFrame& frame);
+	__inline HANDLE event() const {return event_;}
+
+	/* thread pool waits on event() (rtsp_frame_awaitable.h), see CRTSPClient::register_frame_wait().
+	 * A wait stays listed until its callback takes it in begin_wait_callback(); the destructor cancels whatever is left */
+	bool add_wait(SLive_RtspFrameWait* wait, WAITORTIMERCALLBACK callback);
+	bool begin_wait_callback(SLive_RtspFrameWait* wait);
+	void end_wait_callback();
+	void cancel_waits();
+
+private:
+	CRtspFrameQueue(const CRtspFrameQueue&);
+	CRtspFrameQueue& operator=(const CRtspFrameQueue&);
+
+	int numa_node_;
+	int slot_count_;
+	unsigned slot_size_;
+	std::vector<unsigned char*> slots_;
+	std::vector<int> spare_;
+	CSpscRing<int> free_;
+	CSpscRing<SLive_RtspFrame> ready_;
+
+	rtsp_data_callback data_cb_;
+	void* data_cb_user_;
+
+	HANDLE event_;					//manual reset, set while "ready_" may hold frames
+	volatile LONG armed_;			//the consumer found the queue empty and wants a SetEvent for the next frame
+
+	CClientMutex waits_mutex_;
+	std::list<SLive_RtspFrameWait*> waits_;
+	bool closing_;					//cancel_waits() has run, nothing registers any more
+	volatile LONG wait_callbacks_;	//callbacks between begin_wait_callback() and end_wait_callback()
+};
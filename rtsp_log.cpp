@@ -0,0 +1,281 @@
+#include <process.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <vector>
+
+#include "rtsp_log.h"
+
+static const char* phase_name(ELive_RtspPhase phase)
+{
+	switch(phase)
+	{
+	case LIVE_PHASE_CONNECT:	return "CONNECT";
+	case LIVE_PHASE_DESCRIBE:	return "DESCRIBE";
+	case LIVE_PHASE_SETUP:		return "SETUP";
+	case LIVE_PHASE_PLAY:		return "PLAY";
+	case LIVE_PHASE_STREAMING:	return "STREAMING";
+	case LIVE_PHASE_TEARDOWN:	return "TEARDOWN";
+	default:					return "?";
+	}
+}
+
+static const char* level_name(ELive_RtspLogLevel level)
+{
+	switch(level)
+	{
+	case LIVE_LOG_LEVEL_ERROR:	return "E";
+	case LIVE_LOG_LEVEL_WARN:	return "W";
+	case LIVE_LOG_LEVEL_INFO:	return "I";
+	case LIVE_LOG_LEVEL_DEBUG:	return "D";
+	default:					return "?";
+	}
+}
+
+static unsigned __int64 now_us()
+{
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+
+	unsigned __int64 t = ((unsigned __int64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return (t - 116444736000000000ULL) / 10;	/* 100ns ticks since 1601 -> us since 1970 */
+}
+
+unsigned rtsp_url_hash(const char* url)
+{
+	unsigned hash = 2166136261u;
+	for(; url != NULL && *url != '\0'; ++url)
+	{
+		hash ^= (unsigned char)*url;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+CRtspLogStream::CRtspLogStream(unsigned stream_id, const char* url, volatile long* level)
+	: stream_id_(stream_id),
+	url_hash_(rtsp_url_hash(url)),
+	level_(level),
+	closed_(0),
+	dropped_(0),
+	dropped_reported_(0),
+	ring_(RTSP_LOG_RING_SIZE)
+{
+}
+
+void CRtspLogStream::write(ELive_RtspLogLevel level, ELive_RtspPhase phase, int result_code, const char* fmt, ...)
+{
+	SRtspLogEntry entry;
+	entry.record.level = level;
+	entry.record.stream_id = stream_id_;
+	entry.record.url_hash = url_hash_;
+	entry.record.phase = phase;
+	entry.record.result_code = result_code;
+	entry.record.timestamp_us = now_us();
+	entry.record.message = NULL;	/* pointed at the text by the flush thread, the entry is copied through the ring */
+
+	va_list args;
+	va_start(args, fmt);
+	_vsnprintf_s(entry.text, sizeof(entry.text), _TRUNCATE, fmt, args);
+	va_end(args);
+
+	if(!ring_.push(entry))
+	{
+		InterlockedExchange(&dropped_, dropped_ + 1);
+	}
+}
+
+/* the length of the next record's worth of "text": up to the last line break that fits, or a hard cut */
+static size_t text_chunk(const char* text, size_t length, size_t chunk_size)
+{
+	if(length <= chunk_size) return length;
+
+	for(size_t i = chunk_size; i > 0; --i)
+	{
+		if('\n' == text[i - 1]) return i;
+	}
+	return chunk_size;
+}
+
+void CRtspLogStream::write_text(ELive_RtspLogLevel level, ELive_RtspPhase phase, int result_code, const char* title, const char* text)
+{
+	size_t title_length = strlen(title);
+	size_t chunk_size = (title_length + 64 < RTSP_LOG_MESSAGE_SIZE / 2) ? RTSP_LOG_MESSAGE_SIZE - title_length - 32 : RTSP_LOG_MESSAGE_SIZE / 2;
+	size_t length = strlen(text);
+
+	int parts = 0;
+	for(size_t offset = 0; offset < length; ++parts) offset += text_chunk(text + offset, length - offset, chunk_size);
+
+	int part = 1;
+	for(size_t offset = 0; offset < length; ++part)
+	{
+		size_t chunk = text_chunk(text + offset, length - offset, chunk_size);
+		if(1 == parts)
+		{
+			write(level, phase, result_code, "%s:\n%.*s", title, (int)chunk, text + offset);
+		}
+		else
+		{
+			write(level, phase, result_code, "%s (%d/%d):\n%.*s", title, part, parts, (int)chunk, text + offset);
+		}
+		offset += chunk;
+	}
+}
+
+
+CRtspLogger& CRtspLogger::instance()
+{
+	/* constructed on first use: CRTSPClient instances at namespace scope in other translation units may need it first */
+	static CRtspLogger logger;
+	return logger;
+}
+
+CRtspLogger::CRtspLogger()
+	: log_cb_(NULL),
+	log_cb_user_(NULL),
+	default_level_(LIVE_LOG_LEVEL_INFO),
+	flush_thread_(NULL)
+{
+	wakeup_event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+	stop_event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+CRtspLogger::~CRtspLogger()
+{
+	if(NULL != flush_thread_)
+	{
+		/* the thread drains every ring once more before it exits; streams still open belong to running loops and are left alone */
+		SetEvent(stop_event_);
+		WaitForSingleObject(flush_thread_, RTSP_LOG_STOP_TIMEOUT);
+		CloseHandle(flush_thread_);
+	}
+	CloseHandle(stop_event_);
+	CloseHandle(wakeup_event_);
+}
+
+void CRtspLogger::set_callback(rtsp_log_callback log_cb, void* user_param)
+{
+	mutex_.get_mutex();
+	log_cb_ = log_cb;
+	log_cb_user_ = user_param;
+	mutex_.release_mutex();
+}
+
+CRtspLogStream* CRtspLogger::open_stream(unsigned stream_id, const char* url, volatile long* level)
+{
+	CRtspLogStream* stream = new CRtspLogStream(stream_id, url, level);
+
+	mutex_.get_mutex();
+	streams_.push_back(stream);
+	if(NULL == flush_thread_)
+	{
+		flush_thread_ = (HANDLE)_beginthreadex(NULL, 0, flush_thread, this, 0, NULL);
+	}
+	mutex_.release_mutex();
+
+	return stream;
+}
+
+void CRtspLogger::close_stream(CRtspLogStream* stream)
+{
+	if(NULL == stream) return;
+
+	InterlockedExchange(&stream->closed_, 1);
+	SetEvent(wakeup_event_);
+}
+
+unsigned CRtspLogger::flush_thread(void* param)
+{
+	CRtspLogger* logger = (CRtspLogger*)param;
+
+	HANDLE events[2] = {logger->stop_event_, logger->wakeup_event_};
+	while(WAIT_OBJECT_0 != WaitForMultipleObjects(2, events, FALSE, RTSP_LOG_FLUSH_INTERVAL))
+	{
+		logger->flush();
+	}
+	logger->flush();
+
+	return 0;
+}
+
+void CRtspLogger::flush()
+{
+	/* snapshot the stream list so the callback never runs under the registration lock */
+	std::vector<CRtspLogStream*> streams;
+	rtsp_log_callback log_cb;
+	void* log_cb_user;
+
+	mutex_.get_mutex();
+	streams.assign(streams_.begin(), streams_.end());
+	log_cb = log_cb_;
+	log_cb_user = log_cb_user_;
+	mutex_.release_mutex();
+
+	std::vector<CRtspLogStream*> finished;
+	for(size_t i = 0; i < streams.size(); ++i)
+	{
+		CRtspLogStream* stream = streams[i];
+
+		/* read "closed" first: once it is set the producer is gone, so an empty ring stays empty */
+		bool closed = (0 != stream->closed_);
+
+		SRtspLogEntry entry;
+		while(stream->ring_.pop(entry))
+		{
+			entry.record.message = entry.text;
+			emit(log_cb, log_cb_user, entry.record);
+		}
+
+		LONG dropped = stream->dropped_;
+		if(dropped != stream->dropped_reported_)
+		{
+			char text[64];
+			_snprintf_s(text, sizeof(text), _TRUNCATE, "%ld log records dropped", dropped - stream->dropped_reported_);
+			stream->dropped_reported_ = dropped;
+
+			SLive_RtspLogRecord record;
+			record.level = LIVE_LOG_LEVEL_WARN;
+			record.stream_id = stream->stream_id_;
+			record.url_hash = stream->url_hash_;
+			record.phase = LIVE_PHASE_STREAMING;
+			record.result_code = 0;
+			record.timestamp_us = now_us();
+			record.message = text;
+			emit(log_cb, log_cb_user, record);
+		}
+
+		if(closed) finished.push_back(stream);
+	}
+
+	if(finished.empty()) return;
+
+	mutex_.get_mutex();
+	for(size_t i = 0; i < finished.size(); ++i)
+	{
+		streams_.remove(finished[i]);
+		delete finished[i];
+	}
+	mutex_.release_mutex();
+}
+
+void CRtspLogger::emit(rtsp_log_callback log_cb, void* user_param, const SLive_RtspLogRecord& record)
+{
+	if(NULL != log_cb)
+	{
+		log_cb(&record, user_param);
+		return;
+	}
+
+	if(0 != record.result_code)
+	{
+		fprintf(stderr, "%s [stream %u url#%08x %s] (%d) %s\n", level_name(record.level), record.stream_id, record.url_hash,
+			phase_name(record.phase), record.result_code, record.message);
+	}
+	else
+	{
+		fprintf(stderr, "%s [stream %u url#%08x %s] %s\n", level_name(record.level), record.stream_id, record.url_hash,
+			phase_name(record.phase), record.message);
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+/* Asynchronous logging for the stream event loops.
+ * Each loop thread owns one CRtspLogStream and is the only producer of its ring; a single background
+ * thread drains all rings and hands the records to the user callback (or stderr).  A disabled level
+ * costs one compare on the loop thread: RTSP_LOG does not evaluate its format arguments in that case. */
+
+#include <list>
+
+#include "parse_rtsp.h"
+#include "rtsp_spsc_ring.h"
+
+#define RTSP_LOG_MESSAGE_SIZE	512
+#define RTSP_LOG_RING_SIZE		64
+#define RTSP_LOG_FLUSH_INTERVAL	20		//ms
+#define RTSP_LOG_STOP_TIMEOUT	1000	//ms, the flush thread cannot finish while the loader lock is held (DLL unload)
+
+typedef struct SRtspLogEntry
+{
+	SLive_RtspLogRecord record;
+	char text[RTSP_LOG_MESSAGE_SIZE];
+}SRtspLogEntry;
+
+unsigned rtsp_url_hash(const char* url);
+
+class CRtspLogStream
+{
+public:
+	__inline bool enabled(ELive_RtspLogLevel level) const {return (long)level <= *level_;}
+	void write(ELive_RtspLogLevel level, ELive_RtspPhase phase, int result_code, const char* fmt, ...);
+	/* "text" longer than one record (an SDP) goes out as "title (i/n):" records of whole lines */
+	void write_text(ELive_RtspLogLevel level, ELive_RtspPhase phase, int result_code, const char* title, const char* text);
+
+	__inline unsigned stream_id() const {return stream_id_;}
+
+private:
+	friend class CRtspLogger;
+
+	CRtspLogStream(unsigned stream_id, const char* url, volatile long* level);
+	~CRtspLogStream(){}
+
+	unsigned stream_id_;
+	unsigned url_hash_;
+	volatile long* level_;			//owned by CRTSPClient, adjustable at runtime
+	volatile LONG closed_;
+	volatile LONG dropped_;			//records lost because the ring was full, written by the producer only
+	LONG dropped_reported_;			//flush thread only
+	CSpscRing<SRtspLogEntry> ring_;
+};
+
+class CRtspLogger
+{
+public:
+	static CRtspLogger& instance();
+
+	void set_callback(rtsp_log_callback log_cb, void* user_param);
+	__inline void set_default_level(ELive_RtspLogLevel level){default_level_ = level;}
+	__inline ELive_RtspLogLevel default_level() const {return (ELive_RtspLogLevel)default_level_;}
+
+	/* open_stream() is called on the loop thread before the first record; after close_stream() the loop thread
+	 * must not touch the stream again, the flush thread drains what is left and frees it */
+	CRtspLogStream* open_stream(unsigned stream_id, const char* url, volatile long* level);
+	void close_stream(CRtspLogStream* stream);
+
+private:
+	CRtspLogger();
+	~CRtspLogger();
+
+	static unsigned __stdcall flush_thread(void* param);
+	void flush();
+	void emit(rtsp_log_callback log_cb, void* user_param, const SLive_RtspLogRecord& record);
+
+	CClientMutex mutex_;
+	std::list<CRtspLogStream*> streams_;
+	rtsp_log_callback log_cb_;
+	void* log_cb_user_;
+	volatile long default_level_;
+	HANDLE wakeup_event_;
+	HANDLE stop_event_;
+	HANDLE flush_thread_;
+};
+
+#define RTSP_LOG(stream, level, phase, result_code, ...) \
+	do { if((stream) != NULL && (stream)->enabled(level)) (stream)->write((level), (phase), (result_code), __VA_ARGS__); } while(0)
+#define RTSP_LOG_TEXT(stream, level, phase, result_code, title, text) \
+	do { if((stream) != NULL && (stream)->enabled(level)) (stream)->write_text((level), (phase), (result_code), (title), (text)); } while(0)
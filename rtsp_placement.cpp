@@ -0,0 +1,79 @@
+#include <string.h>
+
+#include "rtsp_placement.h"
+
+static int current_numa_node()
+{
+	PROCESSOR_NUMBER processor;
+	GetCurrentProcessorNumberEx(&processor);
+
+	USHORT node = 0;
+	if(!GetNumaProcessorNodeEx(&processor, &node)) return -1;
+
+	return node;
+}
+
+int rtsp_apply_placement(const SLive_RtspPlacement& placement, DWORD& error)
+{
+	error = 0;
+	if(0 != placement.cpu_mask)
+	{
+		GROUP_AFFINITY affinity;
+		memset(&affinity, 0, sizeof(affinity));
+		affinity.Group = placement.cpu_group;
+		affinity.Mask = (KAFFINITY)placement.cpu_mask;
+
+		if(!SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL))
+		{
+			error = GetLastError();
+			return placement.numa_node;
+		}
+
+		/* make sure we are already running inside the new mask before asking for our node */
+		SwitchToThread();
+	}
+
+	if(placement.numa_node >= 0) return placement.numa_node;
+
+	/* without a mask the OS may still move us across nodes later, so only trust the node of a pinned thread */
+	return (0 != placement.cpu_mask) ? current_numa_node() : -1;
+}
+
+SLive_RtspPlacement rtsp_placement_of_current_thread()
+{
+	SLive_RtspPlacement placement;
+
+	int node = current_numa_node();
+	if(node < 0) return placement;
+
+	GROUP_AFFINITY affinity;
+	if(!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity)) return placement;
+
+	placement.cpu_group = affinity.Group;
+	placement.cpu_mask = affinity.Mask;
+	placement.numa_node = node;
+	return placement;
+}
+
+unsigned char* rtsp_alloc_buffer(size_t size, int numa_node)
+{
+	void* buffer = NULL;
+	if(numa_node >= 0)
+	{
+		buffer = VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD)numa_node);
+	}
+	if(NULL == buffer)
+	{
+		buffer = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+
+	return (unsigned char*)buffer;
+}
+
+void rtsp_free_buffer(unsigned char* buffer)
+{
+	if(NULL != buffer)
+	{
+		VirtualFree(buffer, 0, MEM_RELEASE);
+	}
+}
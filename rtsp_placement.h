@@ -0,0 +1,16 @@
+#pragma once
+
+/* CPU / NUMA placement of a stream's event loop thread and of the buffers it receives into. */
+
+#include "parse_rtsp.h"
+
+/* pins the calling thread as described by "placement"; returns the NUMA node its buffers should live on (-1 = unknown).
+ * "error" is the GetLastError() of a failed SetThreadGroupAffinity (the thread then stays where it was), else 0 */
+int rtsp_apply_placement(const SLive_RtspPlacement& placement, DWORD& error);
+
+/* placement covering the NUMA node the calling thread is currently running on */
+SLive_RtspPlacement rtsp_placement_of_current_thread();
+
+/* receive buffers: preferred on "numa_node" when it is >= 0, released with rtsp_free_buffer() */
+unsigned char* rtsp_alloc_buffer(size_t size, int numa_node);
+void rtsp_free_buffer(unsigned char* buffer);
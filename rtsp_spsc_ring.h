@@ -0,0 +1,60 @@
+#pragma once
+
+/* Single-producer / single-consumer ring buffer.
+ * One thread calls push(), one (other) thread calls pop(); neither side ever blocks or takes a lock.
+ * head_/tail_ are only ever written by their owning side; the volatile reads get acquire semantics
+ * and the InterlockedExchange writes get release semantics under MSVC. */
+
+#include <Windows.h>
+
+template <typename T>
+class CSpscRing
+{
+public:
+	explicit CSpscRing(unsigned capacity)
+		: head_(0), tail_(0)
+	{
+		capacity_ = 1;
+		while(capacity_ < capacity) capacity_ <<= 1;
+		mask_ = capacity_ - 1;
+		slots_ = new T[capacity_];
+	}
+	~CSpscRing(){delete[] slots_;}
+
+	/* producer side */
+	bool push(const T& item)
+	{
+		LONG tail = tail_;
+		if((unsigned)(tail - head_) >= capacity_) return false;	/* full */
+
+		slots_[tail & mask_] = item;
+		InterlockedExchange(&tail_, tail + 1);
+		return true;
+	}
+
+	/* consumer side */
+	bool pop(T& item)
+	{
+		LONG head = head_;
+		if(head == tail_) return false;	/* empty */
+
+		item = slots_[head & mask_];
+		InterlockedExchange(&head_, head + 1);
+		return true;
+	}
+
+	__inline bool empty() const {return head_ == tail_;}
+	__inline unsigned size() const {return (unsigned)(tail_ - head_);}
+	__inline unsigned capacity() const {return capacity_;}
+
+private:
+	CSpscRing(const CSpscRing&);
+	CSpscRing& operator=(const CSpscRing&);
+
+	T* slots_;
+	unsigned capacity_;
+	unsigned mask_;
+	volatile LONG head_;
+	char pad_[64];			/* keep the consumer and producer indexes on separate cache lines */
+	volatile LONG tail_;
+};
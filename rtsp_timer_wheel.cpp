@@ -0,0 +1,212 @@
+#include "BasicUsageEnvironment.hh"
+
+#include "rtsp_timer_wheel.h"
+
+#define L0_SIZE		(1 << RTSP_TIMER_WHEEL_L0_BITS)
+#define L0_MASK		(L0_SIZE - 1)
+#define LN_SIZE		(1 << RTSP_TIMER_WHEEL_LN_BITS)
+#define LN_MASK		(LN_SIZE - 1)
+#define LEVEL_SHIFT(level)	(RTSP_TIMER_WHEEL_L0_BITS + ((level) - 1) * RTSP_TIMER_WHEEL_LN_BITS)	/* level >= 1 */
+#define MAX_TICKS	(((unsigned __int64)1 << LEVEL_SHIFT(RTSP_TIMER_WHEEL_LEVELS)) - 1)
+
+CRtspTimerWheel::CRtspTimerWheel(TaskScheduler& scheduler)
+	: scheduler_(scheduler),
+	tick_task_(NULL),
+	in_tick_(false),
+	armed_count_(0),
+	jiffies_(0),
+	last_tick_ms_(0),
+	carry_ms_(0)
+{
+	for(int i = 0; i < L0_SIZE; ++i) list_init(wheel0_[i]);
+	for(int level = 0; level < RTSP_TIMER_WHEEL_LEVELS - 1; ++level)
+	{
+		for(int i = 0; i < LN_SIZE; ++i) list_init(wheeln_[level][i]);
+	}
+}
+
+CRtspTimerWheel::~CRtspTimerWheel()
+{
+	scheduler_.unscheduleDelayedTask(tick_task_);
+
+	/* whatever is still armed belongs to somebody else; leave it disarmed so a later cancel() does not touch us */
+	SRtspTimer* heads[RTSP_TIMER_WHEEL_LEVELS];
+	int sizes[RTSP_TIMER_WHEEL_LEVELS];
+	heads[0] = wheel0_;
+	sizes[0] = L0_SIZE;
+	for(int level = 1; level < RTSP_TIMER_WHEEL_LEVELS; ++level)
+	{
+		heads[level] = wheeln_[level - 1];
+		sizes[level] = LN_SIZE;
+	}
+
+	for(int level = 0; level < RTSP_TIMER_WHEEL_LEVELS; ++level)
+	{
+		for(int i = 0; i < sizes[level]; ++i)
+		{
+			SRtspTimer& head = heads[level][i];
+			while(head.next != &head)
+			{
+				SRtspTimer* timer = head.next;
+				head.next = timer->next;
+				timer->prev = NULL;
+				timer->next = NULL;
+			}
+		}
+	}
+}
+
+void CRtspTimerWheel::arm(SRtspTimer& timer, unsigned delay_ms, rtsp_timer_proc* proc, void* client_data)
+{
+	cancel(timer);
+
+	timer.wheel = this;
+	timer.expires = jiffies_ + (delay_ms + RTSP_TIMER_WHEEL_TICK - 1) / RTSP_TIMER_WHEEL_TICK;
+	timer.proc = proc;
+	timer.client_data = client_data;
+	add(timer);
+	++armed_count_;
+
+	/* the wheel only turns while something is armed; tick() reschedules itself when it is the one arming */
+	if(NULL == tick_task_ && !in_tick_)
+	{
+		last_tick_ms_ = GetTickCount();
+		carry_ms_ = 0;
+		tick_task_ = scheduler_.scheduleDelayedTask(RTSP_TIMER_WHEEL_TICK * 1000, tick_handler, this);
+	}
+}
+
+void CRtspTimerWheel::cancel(SRtspTimer& timer)
+{
+	if(!armed(timer)) return;
+
+	timer.prev->next = timer.next;
+	timer.next->prev = timer.prev;
+	timer.prev = NULL;
+	timer.next = NULL;
+	--timer.wheel->armed_count_;
+}
+
+void CRtspTimerWheel::tick_handler(void* client_data)
+{
+	((CRtspTimerWheel*)client_data)->tick();
+}
+
+void CRtspTimerWheel::tick()
+{
+	tick_task_ = NULL;
+
+	/* catch up with real time, the loop may have been busy for several ticks */
+	DWORD now = GetTickCount();
+	DWORD elapsed_ms = now - last_tick_ms_ + carry_ms_;
+	last_tick_ms_ = now;
+	carry_ms_ = elapsed_ms % RTSP_TIMER_WHEEL_TICK;
+
+	in_tick_ = true;
+	run_until(jiffies_ + elapsed_ms / RTSP_TIMER_WHEEL_TICK);
+	in_tick_ = false;
+
+	if(armed_count_ > 0)
+	{
+		tick_task_ = scheduler_.scheduleDelayedTask((RTSP_TIMER_WHEEL_TICK - carry_ms_) * 1000, tick_handler, this);
+	}
+}
+
+void CRtspTimerWheel::run_until(unsigned __int64 jiffies)
+{
+	while(jiffies_ < jiffies && armed_count_ > 0)
+	{
+		int index = (int)(jiffies_ & L0_MASK);
+		if(0 == index) cascade(1);
+
+		/* detach the slot first: a proc may arm, cancel or re-arm any timer, including the ones still pending here */
+		SRtspTimer pending;
+		list_init(pending);
+		SRtspTimer& head = wheel0_[index];
+		if(head.next != &head)
+		{
+			pending.next = head.next;
+			pending.prev = head.prev;
+			pending.next->prev = &pending;
+			pending.prev->next = &pending;
+			list_init(head);
+		}
+
+		++jiffies_;
+
+		while(pending.next != &pending)
+		{
+			SRtspTimer* timer = pending.next;
+			cancel(*timer);
+			timer->proc(timer->client_data);
+		}
+	}
+
+	/* nothing armed: skip ahead instead of turning an empty wheel */
+	if(jiffies_ < jiffies) jiffies_ = jiffies;
+}
+
+void CRtspTimerWheel::add(SRtspTimer& timer)
+{
+	if(timer.expires < jiffies_) timer.expires = jiffies_;
+	if(timer.expires - jiffies_ > MAX_TICKS) timer.expires = jiffies_ + MAX_TICKS;
+
+	unsigned __int64 delta = timer.expires - jiffies_;
+	if(delta < L0_SIZE)
+	{
+		list_append(wheel0_[timer.expires & L0_MASK], timer);
+		return;
+	}
+
+	for(int level = 1; level < RTSP_TIMER_WHEEL_LEVELS; ++level)
+	{
+		if(delta < ((unsigned __int64)1 << LEVEL_SHIFT(level + 1)) || RTSP_TIMER_WHEEL_LEVELS - 1 == level)
+		{
+			list_append(wheeln_[level - 1][(timer.expires >> LEVEL_SHIFT(level)) & LN_MASK], timer);
+			return;
+		}
+	}
+}
+
+void CRtspTimerWheel::cascade(int level)
+{
+	/* the level below has gone round once: spread this level's current slot over it.  When this level has gone round as
+	 * well (index 0), the level above follows, after this one (lower level first, as in Linux) */
+	int index = (int)((jiffies_ >> LEVEL_SHIFT(level)) & LN_MASK);
+
+	SRtspTimer pending;
+	list_init(pending);
+	SRtspTimer& head = wheeln_[level - 1][index];
+	if(head.next != &head)
+	{
+		pending.next = head.next;
+		pending.prev = head.prev;
+		pending.next->prev = &pending;
+		pending.prev->next = &pending;
+		list_init(head);
+	}
+
+	while(pending.next != &pending)
+	{
+		SRtspTimer* timer = pending.next;
+		pending.next = timer->next;
+		timer->next->prev = &pending;
+		add(*timer);
+	}
+
+	if(0 == index && level < RTSP_TIMER_WHEEL_LEVELS - 1) cascade(level + 1);
+}
+
+void CRtspTimerWheel::list_init(SRtspTimer& head)
+{
+	head.prev = &head;
+	head.next = &head;
+}
+
+void CRtspTimerWheel::list_append(SRtspTimer& head, SRtspTimer& timer)
+{
+	timer.prev = head.prev;
+	timer.next = &head;
+	head.prev->next = &timer;
+	head.prev = &timer;
+}
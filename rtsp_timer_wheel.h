@@ -0,0 +1,80 @@
+#pragma once
+
+/* Hierarchical timing wheel of one event loop.
+ * Watchdogs, keep-alives, reconnect backoff and duration timers all live here instead of live555's delay queue
+ * (a sorted list, O(n) per insertion); the wheel itself occupies a single delayed task that is only scheduled
+ * while some timer is armed.  Timers are intrusive list nodes owned by the caller, so arm() and cancel() are O(1)
+ * and never allocate.  Level 0 has 256 slots of one tick, each further level 64 slots of 64 times the span below;
+ * timers are cascaded down as the wheel turns (the classic Varghese & Lauck scheme). */
+
+#include "parse_rtsp.h"
+
+#define RTSP_TIMER_WHEEL_TICK		100		//ms
+#define RTSP_TIMER_WHEEL_L0_BITS	8
+#define RTSP_TIMER_WHEEL_LN_BITS	6
+#define RTSP_TIMER_WHEEL_LEVELS		4		//256 * 64^3 ticks, about 77 days
+
+class TaskScheduler;
+class CRtspTimerWheel;
+
+typedef void rtsp_timer_proc(void* client_data);
+
+typedef struct SRtspTimer
+{
+	SRtspTimer* prev;				//NULL while not armed
+	SRtspTimer* next;
+	CRtspTimerWheel* wheel;
+	unsigned __int64 expires;		//in wheel ticks
+	rtsp_timer_proc* proc;
+	void* client_data;
+
+	SRtspTimer()
+	{
+		prev = NULL;
+		next = NULL;
+		wheel = NULL;
+		expires = 0;
+		proc = NULL;
+		client_data = NULL;
+	}
+}SRtspTimer;
+
+class CRtspTimerWheel
+{
+public:
+	CRtspTimerWheel(TaskScheduler& scheduler);
+	~CRtspTimerWheel();
+
+	/* (re)arms "timer" to call proc(client_data) after "delay_ms"; may be called from inside a timer proc */
+	void arm(SRtspTimer& timer, unsigned delay_ms, rtsp_timer_proc* proc, void* client_data);
+	static void cancel(SRtspTimer& timer);
+	static __inline bool armed(const SRtspTimer& timer) {return NULL != timer.prev;}
+
+	/* the current time in ticks; cheap enough to be stored on every frame */
+	__inline unsigned __int64 now() const {return jiffies_;}
+	static __inline unsigned ticks_to_ms(unsigned __int64 ticks) {return (unsigned)(ticks * RTSP_TIMER_WHEEL_TICK);}
+
+private:
+	CRtspTimerWheel(const CRtspTimerWheel&);
+	CRtspTimerWheel& operator=(const CRtspTimerWheel&);
+
+	static void tick_handler(void* client_data);
+	void tick();
+	void run_until(unsigned __int64 jiffies);
+	void add(SRtspTimer& timer);
+	void cascade(int level);
+
+	static void list_init(SRtspTimer& head);
+	static void list_append(SRtspTimer& head, SRtspTimer& timer);
+
+	TaskScheduler& scheduler_;
+	void* tick_task_;				//live555 TaskToken of our one delayed task, NULL while idle
+	bool in_tick_;
+	int armed_count_;
+	unsigned __int64 jiffies_;		//next tick to run
+	DWORD last_tick_ms_;
+	DWORD carry_ms_;
+
+	SRtspTimer wheel0_[1 << RTSP_TIMER_WHEEL_L0_BITS];
+	SRtspTimer wheeln_[RTSP_TIMER_WHEEL_LEVELS - 1][1 << RTSP_TIMER_WHEEL_LN_BITS];
+};